@@ -4,12 +4,15 @@
 
 import argparse
 from enum import Enum
+import json
 import math
 import os
 from pathlib import Path
 import signal
 import subprocess
-from typing import List, Tuple
+import sys
+import tempfile
+from typing import Dict, List, Optional, Tuple
 import numpy as np
 import scipy.stats
 
@@ -35,6 +38,22 @@ def parse_args():
                         help="allocator name, default to \"mymalloc\"")
     parser.add_argument("-i", "--invocations", type=int, default=10,
                         help="number of invocations of the benchmark")
+    parser.add_argument("-f", "--flags", type=str, default="",
+                        help="extra make variables, e.g. \"HUGEPAGES=1\"")
+    parser.add_argument("-b", "--benchmark", type=str, default="benchmark",
+                        help="benchmark in bench/ to run, default to \"benchmark\"")
+    parser.add_argument("-a", "--args", type=str, default="",
+                        help="arguments passed to the benchmark")
+    parser.add_argument("-p", "--policies", type=str, default="",
+                        help="comma-separated placement policies to compare, e.g. \"best,first,next,good\"")
+    parser.add_argument("-j", "--json", type=str,
+                        help="write the time and event counters of every invocation to this file")
+    parser.add_argument("-c", "--compare", type=str, nargs=2, metavar=("BASE", "NEW"),
+                        help="compare two files written by --json instead of running anything")
+    parser.add_argument("--alpha", type=float, default=0.05,
+                        help="significance level of the comparison over all metrics, default to 0.05")
+    parser.add_argument("--threshold", type=float, default=1.0,
+                        help="smallest change in percent flagged by the comparison, default to 1.0")
     return parser.parse_args()
 
 
@@ -138,32 +157,43 @@ def check_test(test: str, output: bytes, exit_code: SubprocessExit, path: Path):
             "UTF-8"), "exit_code": exit_code})
 
 
-def run_benchmark_once(path: str, cwd: Path, i: int) -> Tuple[bytes, float, SubprocessExit]:
+def run_benchmark_once(path: str, args: List[str], cwd: Path, i: int) -> Tuple[bytes, float, Dict[str, Optional[float]], SubprocessExit]:
+    # The benchmark writes its event counters (bench/counters.h) to this file
+    fd, counters_path = tempfile.mkstemp(prefix="bench_counters_", suffix=".json")
+    os.close(fd)
+    env = os.environ.copy()
+    env["BENCH_COUNTERS"] = counters_path
     try:
         print(f"{bcolors.OKCYAN}Running {bcolors.BOLD}{get_test_name(path)} #{i} {bcolors.ENDC}",
               end='', flush=True)
         p = subprocess.run(
-            [path],
+            [path] + args,
             check=True,
-            env=os.environ.copy(),
+            env=env,
             stdout=subprocess.PIPE,
             stderr=subprocess.STDOUT,
             timeout=TIMEOUT,
             cwd=cwd
         )
-        time = float(p.stdout.decode("utf-8").strip())
+        # Some benchmarks print more results after the time
+        time = float(p.stdout.decode("utf-8").split()[0])
+        with open(counters_path) as f:
+            text = f.read()
+        counters = json.loads(text) if text else {}
         print(f"{bcolors.OKGREEN}OK ({time:.3f}s){bcolors.ENDC}", flush=True)
-        return p.stdout, time, SubprocessExit.Normal
+        return p.stdout, time, counters, SubprocessExit.Normal
     except subprocess.CalledProcessError as e:
         if -e.returncode in signal.valid_signals():
             exit_signal = bytearray(e.stdout)
             exit_signal.extend(
                 bytes(f"{signal.strsignal(-e.returncode)}", "UTF-8"))
             e.stdout = bytes(exit_signal)
-        return e.stdout, -1, SubprocessExit.Error
+        return e.stdout, -1, {}, SubprocessExit.Error
     except subprocess.TimeoutExpired as e:
         out = f"Timed out after {TIMEOUT}s"
-        return bytes(out, "UTF-8"), -1, SubprocessExit.Timeout
+        return bytes(out, "UTF-8"), -1, {}, SubprocessExit.Timeout
+    finally:
+        os.unlink(counters_path)
 
 
 def calc_mean_with_ci(x: List[float], confidence=0.95) -> Tuple[float, float]:
@@ -176,13 +206,15 @@ def calc_mean_with_ci(x: List[float], confidence=0.95) -> Tuple[float, float]:
     return (m, h)
 
 
-def run_benchmark(path: str, invocations: int, cwd: Path):
+def run_benchmark(path: str, args: List[str], invocations: int, cwd: Path):
     print(f"{bcolors.OKCYAN}Start benchmark with {bcolors.ENDC}{bcolors.OKCYAN}{bcolors.BOLD}{invocations}{bcolors.ENDC}{bcolors.OKCYAN} invocations.{bcolors.ENDC}", flush=True)
     times = []
+    counters = []
     for i in range(invocations):
-        out, time, exit_code = run_benchmark_once(path, cwd, i)
+        out, time, counts, exit_code = run_benchmark_once(path, args, cwd, i)
         if exit_code == SubprocessExit.Normal:
             times.append(time)
+            counters.append(counts)
         elif exit_code == SubprocessExit.Error:
             print(f"{bcolors.FAIL}FAIL{bcolors.ENDC}", flush=True)
         else:
@@ -197,10 +229,152 @@ def run_benchmark(path: str, invocations: int, cwd: Path):
     else:
         mean, err = calc_mean_with_ci(times)
         print(f"{bcolors.OKGREEN}Average Time: {bcolors.BOLD}{mean:.3f}s ±{err:.3f}{bcolors.ENDC}", flush=True)
+    print_counters(counters)
+    return times, counters
+
+
+def counter_samples(counters: List[Dict[str, Optional[float]]]) -> Dict[str, List[float]]:
+    # Counters the machine does not provide are null and left out
+    samples = {}
+    for counts in counters:
+        for name, value in counts.items():
+            if value is not None:
+                samples.setdefault(name, []).append(value)
+    return samples
+
+
+def print_counters(counters: List[Dict[str, Optional[float]]]):
+    for name, values in counter_samples(counters).items():
+        mean, err = calc_mean_with_ci(values)
+        print(f"{bcolors.OKGREEN}{name:<17} {bcolors.BOLD}{mean:>16.0f} ±{err:.0f}{bcolors.ENDC}", flush=True)
+
+
+def write_json(path: str, args, times: List[float], counters: List[Dict[str, Optional[float]]]):
+    result = {
+        "malloc": args.malloc or "mymalloc",
+        "flags": args.flags,
+        "benchmark": args.benchmark,
+        "args": args.args,
+        "invocations": [{"time": time, "counters": counts}
+                        for time, counts in zip(times, counters)],
+    }
+    with open(path, "w") as f:
+        json.dump(result, f, indent=2)
+        f.write("\n")
+
+
+def welch_p_value(a: List[float], b: List[float]) -> float:
+    if len(a) < 2 or len(b) < 2:
+        return math.nan
+    if np.var(a) == 0 and np.var(b) == 0:
+        # Constant counts, e.g. page faults of a deterministic workload
+        return 1.0 if np.mean(a) == np.mean(b) else 0.0
+    return scipy.stats.ttest_ind(a, b, equal_var=False).pvalue
+
+
+def holm_rejections(p_values: Dict[str, float], alpha: float) -> Dict[str, bool]:
+    # Holm's step-down procedure: the k-th smallest of m p-values is tested
+    # at alpha / (m - k), stopping at the first that is not rejected. This
+    # keeps the chance of any false alarm across all metrics below alpha.
+    rejected = {name: False for name in p_values}
+    # A metric without a p-value (too few runs) is never rejected
+    ordered = sorted(p_values, key=lambda name: math.inf if math.isnan(p_values[name]) else p_values[name])
+    for k, name in enumerate(ordered):
+        if not p_values[name] < alpha / (len(ordered) - k):
+            break
+        rejected[name] = True
+    return rejected
+
+
+def compare_results(base_path: str, new_path: str, alpha: float, threshold: float) -> int:
+    # Lower is better for the time and for every counter. A metric regressed
+    # when it rose by more than `threshold` percent and Welch's t-test rejects
+    # equal means at level `alpha`, after Holm's correction over the metrics.
+    with open(base_path) as f:
+        base = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+    if (base["benchmark"], base["args"]) != (new["benchmark"], new["args"]):
+        print(f"{bcolors.WARNING}Comparing different benchmarks: "
+              f"{base['benchmark']} {base['args']} and {new['benchmark']} {new['args']}{bcolors.ENDC}")
+
+    def metrics(result) -> Dict[str, List[float]]:
+        runs = result["invocations"]
+        samples = {"time": [run["time"] for run in runs]}
+        samples.update(counter_samples([run["counters"] for run in runs]))
+        return samples
+
+    base_samples, new_samples = metrics(base), metrics(new)
+    compared = {name: (before, new_samples[name]) for name, before in base_samples.items()
+                if before and new_samples.get(name)}
+    p_values = {name: welch_p_value(before, after) for name, (before, after) in compared.items()}
+    rejected = holm_rejections(p_values, alpha)
+    regressions = 0
+    print(f"{bcolors.OKCYAN}{'metric':<17} {'base':>16} {'new':>16} {'change':>9} {'p':>7}{bcolors.ENDC}")
+    for name, (before, after) in compared.items():
+        mean_before, mean_after = np.mean(before), np.mean(after)
+        if mean_before == 0:
+            change = 0.0 if mean_after == 0 else math.inf
+        else:
+            change = (mean_after - mean_before) / mean_before * 100
+        p = p_values[name]
+        significant = rejected[name] and abs(change) >= threshold
+        if significant and change > 0:
+            regressions += 1
+            verdict = f"{bcolors.FAIL}REGRESSION{bcolors.ENDC}"
+        elif significant:
+            verdict = f"{bcolors.OKGREEN}improved{bcolors.ENDC}"
+        else:
+            verdict = ""
+        number = "{:>16.3f}" if name == "time" else "{:>16.0f}"
+        print(f"{name:<17} {number.format(mean_before)} {number.format(mean_after)} "
+              f"{change:>+8.2f}% {p:>7.4f} {verdict}", flush=True)
+    if regressions:
+        print(f"{bcolors.FAIL}{regressions} metric(s) regressed{bcolors.ENDC}", flush=True)
+    return 1 if regressions else 0
+
+
+def run_fragmentation(cwd: Path) -> float:
+    # Same trace for every policy: fixed seed, 20000 calls
+    p = subprocess.run(
+        [f"{cwd}/internal-tests/fragmentation", "42", "20000"],
+        check=True,
+        env=os.environ.copy(),
+        stdout=subprocess.PIPE,
+        stderr=subprocess.DEVNULL,
+        timeout=TIMEOUT,
+        cwd=cwd
+    )
+    for line in p.stdout.decode("utf-8").splitlines():
+        if line.startswith("Peak extent utilization:"):
+            return float(line.split(":")[1].strip().rstrip("%"))
+    return -1
+
+
+def compare_policies(policies: List[str], path: str, args: List[str], invocations: int, cwd: Path):
+    results = []
+    for policy in policies:
+        print(f"{bcolors.OKBLUE}=== policy {policy} ==={bcolors.ENDC}", flush=True)
+        os.environ["MYMALLOC_POLICY"] = policy
+        times, _ = run_benchmark(path, args, invocations, cwd)
+        utilization = run_fragmentation(cwd)
+        results.append((policy, times, utilization))
+    del os.environ["MYMALLOC_POLICY"]
+
+    print(f"{bcolors.OKCYAN}{'policy':<8} {'time':>16} {'utilization':>12}{bcolors.ENDC}")
+    for policy, times, utilization in results:
+        if len(times) == 0:
+            time = "FAIL"
+        else:
+            mean, err = calc_mean_with_ci(times)
+            time = f"{mean:.3f}s ±{err:.3f}"
+        print(f"{policy:<8} {time:>16} {utilization:>11.2f}%", flush=True)
 
 
 def main():
     args = parse_args()
+    if args.compare:
+        sys.exit(compare_results(args.compare[0], args.compare[1], args.alpha, args.threshold))
 
     script_path = os.path.realpath(__file__)
     script_path = Path(script_path).parent.absolute()
@@ -210,6 +384,8 @@ def main():
     # Build malloc
     build_cmd = f"MALLOC={args.malloc} " if args.malloc is not None else ""
     build_cmd += "RELEASE=1 "
+    if args.flags:
+        build_cmd += f"{args.flags} "
     output, exit_code = make(build_cmd, script_path)
     check_make(build_cmd, output, exit_code)
     # Build benchmarks
@@ -217,8 +393,17 @@ def main():
         f"bench " + build_cmd, script_path)
     check_make(f"bench", output, exit_code)
     # Run
-    run_benchmark(
-        f"{script_path}/bench/benchmark", args.invocations, script_path)
+    bench_path = f"{script_path}/bench/{args.benchmark}"
+    if args.policies:
+        frag_cmd = "internal-tests/fragmentation " + build_cmd
+        output, exit_code = make(frag_cmd, script_path)
+        check_make(frag_cmd, output, exit_code)
+        compare_policies(args.policies.split(","), bench_path,
+                         args.args.split(), args.invocations, script_path)
+    else:
+        times, counters = run_benchmark(bench_path, args.args.split(), args.invocations, script_path)
+        if args.json:
+            write_json(args.json, args, times, counters)
 
 
 class bcolors:
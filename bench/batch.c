@@ -0,0 +1,76 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark batch allocation against individual calls: each "packet"
+   allocates a few hundred same-size nodes and frees them all together.
+
+   Usage: batch [single|batch] [node_size] */
+
+#define NUM_PACKETS 20000
+#define MAX_NODES 512
+
+static void *nodes[MAX_NODES];
+
+static void run_single(size_t size, int n) {
+  for (int i = 0; i < n; i++) {
+    nodes[i] = mallocing(size);
+  }
+  for (int i = 0; i < n; i++) {
+    *(char *)nodes[i] = 1;
+  }
+  for (int i = 0; i < n; i++) {
+    freeing(nodes[i]);
+  }
+}
+
+static void run_batch(size_t size, int n) {
+  if (my_malloc_batch(size, n, nodes) != (size_t)n) {
+    fprintf(stderr, "my_malloc_batch returned too few nodes. Aborting program\n");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    *(char *)nodes[i] = 1;
+  }
+  my_free_batch(nodes, n);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "%s: [single|batch] [node_size]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int batch = 1;
+  long size = 48;
+  if (argc >= 2) {
+    if (strcmp(argv[1], "single") == 0)
+      batch = 0;
+    else if (strcmp(argv[1], "batch") != 0)
+      usage(argv[0]);
+  }
+  if (argc >= 3)
+    size = strtol(argv[2], NULL, 0);
+  if (argc > 3 || size <= 0)
+    usage(argv[0]);
+
+  srand(1);
+  counters_start();
+  clock_t start_t = clock();
+  for (int p = 0; p < NUM_PACKETS; p++) {
+    int n = 100 + rand() % (MAX_NODES - 100);
+    if (batch)
+      run_batch(size, n);
+    else
+      run_single(size, n);
+  }
+  clock_t end_t = clock();
+  counters_stop();
+  double time_taken = (double)(end_t - start_t) / CLOCKS_PER_SEC;
+  printf("%f\n", time_taken);
+  counters_report();
+  return 0;
+}
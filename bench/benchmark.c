@@ -14,6 +14,7 @@
    <https://www.gnu.org/licenses/>.  */
 
 #include "../tests/testing.h"
+#include "counters.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/resource.h>
@@ -86,6 +87,7 @@ static void usage(const char *name) {
 }
 
 int main(int argc, char **argv) {
+  counters_start();
   clock_t start_t = clock();
   long size = 16;
   if (argc == 2)
@@ -106,7 +108,9 @@ int main(int argc, char **argv) {
     bench(16 * size);
   }
   clock_t end_t = clock();
+  counters_stop();
   double time_taken = (double)(end_t - start_t) / CLOCKS_PER_SEC;
   printf("%f\n", time_taken);
+  counters_report();
   return 0;
 }
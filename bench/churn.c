@@ -0,0 +1,43 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Benchmark allocation under heavy fragmentation: a pool of live objects of
+   random sizes is churned by replacing a random slot each step, which leaves
+   the heap full of free fragments of every size for best fit to search.
+
+   Usage: churn [max_size] */
+
+#define NUM_OPERATIONS 1000000
+#define NUM_SLOTS 4096
+
+static void *slots[NUM_SLOTS];
+
+int main(int argc, char **argv) {
+  long max_size = 4096;
+  if (argc >= 2)
+    max_size = strtol(argv[1], NULL, 0);
+  if (argc > 2 || max_size <= 0) {
+    fprintf(stderr, "%s: [max_size]\n", argv[0]);
+    return 1;
+  }
+
+  srand(1);
+  counters_start();
+  clock_t start_t = clock();
+  for (int i = 0; i < NUM_OPERATIONS; i++) {
+    int slot = rand() % NUM_SLOTS;
+    if (slots[slot] != NULL)
+      freeing(slots[slot]);
+    slots[slot] = mallocing(1 + rand() % max_size);
+    *(char *)slots[slot] = 1;
+  }
+  clock_t end_t = clock();
+  counters_stop();
+  double time_taken = (double)(end_t - start_t) / CLOCKS_PER_SEC;
+  printf("%f\n", time_taken);
+  counters_report();
+  return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef BENCH_COUNTERS_HEADER
+#define BENCH_COUNTERS_HEADER
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Event counters around the measured part of a benchmark. Every
+   counters_start ... counters_stop pair adds to the counts, so a benchmark
+   that times several windows wraps each of them. counters_report writes the
+   counts as one JSON object to the file named by $BENCH_COUNTERS, e.g.
+   {"cycles": 1234, ..., "context_switches": 2}. Without BENCH_COUNTERS the
+   counters are never opened and cost nothing.
+
+   Counts come from perf_event_open. Threads the benchmark starts are only
+   added in once they exit, so the collector's worker threads, which never
+   do, are missing from the gc benchmarks. Hardware counters only count user
+   space, which perf_event_paranoid allows without privileges, and are scaled
+   up when the kernel had to multiplex them. A counter the machine or kernel
+   does not provide (hardware counters in most VMs) is reported as null. */
+
+#ifdef __linux__
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} CounterEvent;
+
+#define CACHE_READ_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const CounterEvent counter_events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"l1d_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"llc_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {"dtlb_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {"minor_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+    {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+#define N_COUNTERS (sizeof(counter_events) / sizeof(counter_events[0]))
+
+// -1 when the counter could not be opened
+static int counter_fds[N_COUNTERS];
+static int counters_opened;
+
+static void counters_open(void) {
+  counters_opened = 1;
+  for (size_t i = 0; i < N_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[i].type;
+    attr.config = counter_events[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = counter_events[i].type != PERF_TYPE_SOFTWARE;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static void counters_start(void) {
+  if (getenv("BENCH_COUNTERS") == NULL)
+    return;
+  if (!counters_opened)
+    counters_open();
+  for (size_t i = 0; i < N_COUNTERS; i++)
+    if (counter_fds[i] >= 0)
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void counters_stop(void) {
+  if (!counters_opened)
+    return;
+  for (size_t i = 0; i < N_COUNTERS; i++)
+    if (counter_fds[i] >= 0)
+      ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static void counters_report(void) {
+  const char *path = getenv("BENCH_COUNTERS");
+  if (path == NULL || !counters_opened)
+    return;
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    exit(1);
+  }
+  fprintf(out, "{");
+  for (size_t i = 0; i < N_COUNTERS; i++) {
+    // value, time enabled, time running
+    uint64_t read_values[3];
+    fprintf(out, "%s\"%s\": ", i == 0 ? "" : ", ", counter_events[i].name);
+    if (counter_fds[i] < 0 ||
+        read(counter_fds[i], read_values, sizeof(read_values)) != sizeof(read_values) ||
+        (read_values[2] == 0 && read_values[1] != 0)) {
+      fprintf(out, "null");
+    } else {
+      double value = read_values[0];
+      if (read_values[2] < read_values[1])
+        value = value * read_values[1] / read_values[2];
+      fprintf(out, "%.0f", value);
+    }
+    if (counter_fds[i] >= 0)
+      close(counter_fds[i]);
+  }
+  fprintf(out, "}\n");
+  fclose(out);
+  counters_opened = 0;
+}
+#else
+static void counters_start(void) {}
+static void counters_stop(void) {}
+
+static void counters_report(void) {
+  const char *path = getenv("BENCH_COUNTERS");
+  if (path == NULL)
+    return;
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    exit(1);
+  }
+  fprintf(out, "{}\n");
+  fclose(out);
+}
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark false sharing between threads. Every thread allocates a small
+   counter, the threads taking turns so their counters are carved one after
+   another, and then bumps its own counter in a loop. Counters on the same
+   cache line make the line bounce between cores.
+
+   shared:    my_malloc with MYMALLOC_THREAD_ARENAS=0, so every thread
+              allocates from the shared arenas
+   threads:   my_malloc, each thread's small blocks come from its own arenas
+   cacheline: my_malloc_hint with MY_HINT_CACHELINE from the shared arenas
+
+   Usage: false_sharing [shared|threads|cacheline] [threads]
+   Prints the time taken by the loops, then how many counters share a line
+   with another thread's. */
+
+#define MAX_THREADS 64
+#define ITERATIONS 100000000L
+
+// A counter in a queue node, as a work queue would keep per thread
+typedef struct {
+  volatile long count;
+  void *next;
+  void *prev;
+} Counter;
+
+static int cacheline;
+static long n_threads = 4;
+static Counter *counters[MAX_THREADS];
+static pthread_barrier_t barrier;
+static volatile int turn;
+
+static void *run(void *arg) {
+  long t = (long)arg;
+  while (turn != t)
+    sched_yield();
+  counters[t] = cacheline ? my_malloc_hint(sizeof(Counter), MY_HINT_CACHELINE)
+                          : my_malloc(sizeof(Counter));
+  CHECK_NULL(counters[t]);
+  counters[t]->count = 0;
+  turn = t + 1;
+
+  pthread_barrier_wait(&barrier);
+  Counter *counter = counters[t];
+  for (long i = 0; i < ITERATIONS / n_threads; i++)
+    counter->count++;
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+static int shares_line(int t) {
+  for (int u = 0; u < n_threads; u++) {
+    uintptr_t a = (uintptr_t)counters[t], b = (uintptr_t)counters[u];
+    if (u != t && a / 64 <= (b + sizeof(Counter) - 1) / 64 && b / 64 <= (a + sizeof(Counter) - 1) / 64)
+      return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2) {
+    if (strcmp(argv[1], "shared") == 0)
+      setenv("MYMALLOC_THREAD_ARENAS", "0", 1);
+    else if (strcmp(argv[1], "cacheline") == 0) {
+      setenv("MYMALLOC_THREAD_ARENAS", "0", 1);
+      cacheline = 1;
+    } else if (strcmp(argv[1], "threads") != 0)
+      argc = 0;
+  }
+  if (argc >= 3)
+    n_threads = strtol(argv[2], NULL, 0);
+  if (argc == 0 || argc > 3 || n_threads <= 0 || n_threads > MAX_THREADS) {
+    fprintf(stderr, "%s: [shared|threads|cacheline] [threads]\n", argv[0]);
+    return 1;
+  }
+
+  // The counters are inherited by threads created after they are opened, and
+  // added up as the threads exit
+  counters_start();
+  pthread_t threads[MAX_THREADS];
+  pthread_barrier_init(&barrier, NULL, n_threads + 1);
+  for (long t = 0; t < n_threads; t++)
+    pthread_create(&threads[t], NULL, run, (void *)t);
+
+  pthread_barrier_wait(&barrier);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_barrier_wait(&barrier);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  for (long t = 0; t < n_threads; t++)
+    pthread_join(threads[t], NULL);
+  counters_stop();
+
+  int sharing = 0;
+  for (int t = 0; t < n_threads; t++)
+    sharing += shares_line(t);
+  double time_taken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%f\n%d\n", time_taken, sharing);
+  counters_report();
+  return 0;
+}
@@ -0,0 +1,95 @@
+#define MYMALLOC_INLINE
+#include "../tests/testing.h"
+#include "counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Benchmark small alloc/free pairs through the library calls against the
+   inline thread-cache fast path in mymalloc.h. Each iteration replaces one of
+   64 live objects with a variable size and allocates and frees one object of
+   a constant size.
+
+   Usage: fastpath [library|inline] [seconds|cycles]
+   Prints the elapsed time, or the TSC cycles per alloc/free pair. */
+
+#define NUM_ITERATIONS 10000000
+#define LIVE 64
+
+static void *live[LIVE];
+static size_t sizes[LIVE];
+
+static unsigned long long ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "%s: [library|inline] [seconds|cycles]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int use_inline = 1;
+  int cycles = 0;
+  if (argc >= 2) {
+    if (strcmp(argv[1], "library") == 0)
+      use_inline = 0;
+    else if (strcmp(argv[1], "inline") != 0)
+      usage(argv[0]);
+  }
+  if (argc >= 3) {
+    if (strcmp(argv[2], "cycles") == 0)
+      cycles = 1;
+    else if (strcmp(argv[2], "seconds") != 0)
+      usage(argv[0]);
+  }
+  if (argc > 3)
+    usage(argv[0]);
+
+  for (int i = 0; i < LIVE; i++)
+    sizes[i] = 8 + (i * 37) % 200;
+
+  counters_start();
+  clock_t start_t = clock();
+  unsigned long long start_ticks = ticks();
+  if (use_inline) {
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+      int slot = i & (LIVE - 1);
+      my_free(live[slot]);
+      live[slot] = my_malloc(sizes[slot]);
+      void *p = my_malloc(32);
+      *(volatile char *)p = 1;
+      my_free(p);
+    }
+  } else {
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+      int slot = i & (LIVE - 1);
+      (my_free)(live[slot]);
+      live[slot] = (my_malloc)(sizes[slot]);
+      void *p = (my_malloc)(32);
+      *(volatile char *)p = 1;
+      (my_free)(p);
+    }
+  }
+  unsigned long long end_ticks = ticks();
+  clock_t end_t = clock();
+  counters_stop();
+
+  if (cycles) {
+    printf("%f\n", (double)(end_ticks - start_ticks) / (2.0 * NUM_ITERATIONS));
+  } else {
+    printf("%f\n", (double)(end_t - start_t) / CLOCKS_PER_SEC);
+  }
+  counters_report();
+  return 0;
+}
@@ -0,0 +1,54 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include "../src/mygc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Benchmark the garbage collector's mark and sweep: a random graph of small
+   nodes, all reachable through one array, is collected a few times. The
+   collections are timed on the wall clock, since they run on several threads.
+
+   Usage: gc [threads] [nodes] */
+
+#define EDGES 4
+#define COLLECTIONS 5
+
+typedef struct Node {
+  struct Node *edges[EDGES];
+} Node;
+
+int main(int argc, char **argv) {
+  set_start_of_stack(__builtin_frame_address(0));
+  long threads = 1;
+  long nodes = 1000000;
+  if (argc >= 2)
+    threads = strtol(argv[1], NULL, 0);
+  if (argc >= 3)
+    nodes = strtol(argv[2], NULL, 0);
+  if (argc > 3 || threads <= 0 || nodes <= 0) {
+    fprintf(stderr, "%s: [threads] [nodes]\n", argv[0]);
+    return 1;
+  }
+
+  Node **all = mallocing(nodes * sizeof(Node *));
+  for (long i = 0; i < nodes; i++)
+    all[i] = mallocing(sizeof(Node));
+  srand(1);
+  for (long i = 0; i < nodes; i++)
+    for (int e = 0; e < EDGES; e++)
+      all[i]->edges[e] = all[rand() % nodes];
+
+  my_gc_set_threads(threads);
+  struct timespec start, end;
+  counters_start();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < COLLECTIONS; i++)
+    my_gc();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  counters_stop();
+  double time_taken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%f\n", time_taken);
+  counters_report();
+  return all[0] == NULL;
+}
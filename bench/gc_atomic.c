@@ -0,0 +1,73 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include "../src/mygc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark collections over a heap holding large byte buffers next to a
+   graph of small nodes. The buffers are allocated with my_gc_alloc, or with
+   my_gc_alloc_atomic so they are not scanned. Their contents are random bytes
+   with the addresses of dead nodes mixed in, as binary data sometimes happens
+   to hold. The time taken by a few collections is printed, then how many dead
+   nodes the buffers kept alive.
+
+   Usage: gc_atomic [plain|atomic] [megabytes] */
+
+#define EDGES 4
+#define NODES 200000
+#define DEAD_NODES 20000
+#define BUFFER_SIZE (1 << 20)
+#define COLLECTIONS 5
+
+typedef struct Node {
+  struct Node *edges[EDGES];
+} Node;
+
+int main(int argc, char **argv) {
+  set_start_of_stack(__builtin_frame_address(0));
+  int atomic = argc >= 2 && strcmp(argv[1], "atomic") == 0;
+  long megabytes = 256;
+  if (argc >= 3)
+    megabytes = strtol(argv[2], NULL, 0);
+  if (argc > 3 || (argc >= 2 && !atomic && strcmp(argv[1], "plain") != 0) || megabytes <= 0) {
+    fprintf(stderr, "%s: [plain|atomic] [megabytes]\n", argv[0]);
+    return 1;
+  }
+
+  Node **all = mallocing(NODES * sizeof(Node *));
+  for (long i = 0; i < NODES; i++)
+    all[i] = mallocing(sizeof(Node));
+  srand(1);
+  for (long i = 0; i < NODES; i++)
+    for (int e = 0; e < EDGES; e++)
+      all[i]->edges[e] = all[rand() % NODES];
+
+  unsigned char **buffers = mallocing(megabytes * sizeof(unsigned char *));
+  for (long b = 0; b < megabytes; b++) {
+    buffers[b] = atomic ? my_gc_alloc_atomic(BUFFER_SIZE) : my_gc_alloc(BUFFER_SIZE);
+    CHECK_NULL(buffers[b]);
+    for (size_t i = 0; i < BUFFER_SIZE; i++)
+      buffers[b][i] = rand();
+  }
+  // Dead nodes whose addresses land in the buffers
+  for (long i = 0; i < DEAD_NODES; i++) {
+    Node *dead = mallocing(sizeof(Node));
+    void **words = (void **)buffers[rand() % megabytes];
+    words[rand() % (BUFFER_SIZE / sizeof(void *))] = dead;
+  }
+
+  struct timespec start, end;
+  counters_start();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t freed = my_gc();
+  for (int i = 1; i < COLLECTIONS; i++)
+    my_gc();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  counters_stop();
+  double time_taken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%f\n%zu\n", time_taken, DEAD_NODES - freed);
+  counters_report();
+  return all[0] == NULL || buffers[0] == NULL;
+}
@@ -0,0 +1,65 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include "../src/mygc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark collection pauses with a large old heap: a graph of old nodes
+   stays live while short-lived objects are allocated with my_gc_alloc, a few
+   of them kept alive at a time. Every COLLECT_EVERY allocations the nursery is
+   collected with a minor collection, or the whole heap with a full one. The
+   total time spent in collections is printed.
+
+   Usage: nursery [minor|full] [old_nodes] */
+
+#define EDGES 4
+#define YOUNG_ALLOCATIONS 2000000
+#define COLLECT_EVERY 200000
+#define LIVE_YOUNG 64
+
+typedef struct Node {
+  struct Node *edges[EDGES];
+} Node;
+
+int main(int argc, char **argv) {
+  set_start_of_stack(__builtin_frame_address(0));
+  int full = argc >= 2 && strcmp(argv[1], "full") == 0;
+  long old_nodes = 500000;
+  if (argc >= 3)
+    old_nodes = strtol(argv[2], NULL, 0);
+  if (argc > 3 || (argc >= 2 && !full && strcmp(argv[1], "minor") != 0) || old_nodes <= 0) {
+    fprintf(stderr, "%s: [minor|full] [old_nodes]\n", argv[0]);
+    return 1;
+  }
+
+  Node **old = mallocing(old_nodes * sizeof(Node *));
+  for (long i = 0; i < old_nodes; i++)
+    old[i] = mallocing(sizeof(Node));
+  srand(1);
+  for (long i = 0; i < old_nodes; i++)
+    for (int e = 0; e < EDGES; e++)
+      old[i]->edges[e] = old[rand() % old_nodes];
+
+  Node *young[LIVE_YOUNG] = {0};
+  double paused = 0;
+  for (long i = 1; i <= YOUNG_ALLOCATIONS; i++) {
+    young[i % LIVE_YOUNG] = my_gc_alloc(sizeof(Node));
+    if (i % COLLECT_EVERY == 0) {
+      struct timespec start, end;
+      counters_start();
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (full)
+        my_gc();
+      else
+        my_gc_minor();
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      counters_stop();
+      paused += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+  }
+  printf("%f\n", paused);
+  counters_report();
+  return old[0] == NULL || young[0] == NULL;
+}
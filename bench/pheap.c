@@ -0,0 +1,154 @@
+#include "../tests/testing.h"
+#include "../src/mypheap.h"
+#include "counters.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Benchmark a warm restart against a rebuild. A chained hash index of `keys`
+   entries is built with my_malloc and looked up once, which is what a service
+   without a persistent heap does on every start. The same index is then built
+   in a persistent heap in `path`, and a fresh process opens the file and looks
+   every key up once. Prints the rebuild time, then the restart time. The
+   counters cover the rebuild and the restart together.
+
+   Usage: pheap [keys] [path] */
+
+typedef struct Entry {
+  struct Entry *next;
+  uint64_t key;
+  uint64_t value;
+} Entry;
+
+// The same entry in a persistent heap, linked by offset
+typedef struct {
+  uint64_t next;
+  uint64_t key;
+  uint64_t value;
+} PEntry;
+
+typedef struct {
+  uint64_t buckets;
+  uint64_t table[];
+} PIndex;
+
+static uint64_t key_of(long i) {
+  return (i + 1) * 0x9E3779B97F4A7C15ull;
+}
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static long rebuild(long keys) {
+  size_t buckets = keys;
+  Entry **table = mallocing(buckets * sizeof(Entry *));
+  for (size_t b = 0; b < buckets; b++)
+    table[b] = NULL;
+  for (long i = 0; i < keys; i++) {
+    Entry *entry = mallocing(sizeof(Entry));
+    entry->key = key_of(i);
+    entry->value = i;
+    entry->next = table[entry->key % buckets];
+    table[entry->key % buckets] = entry;
+  }
+  long found = 0;
+  for (long i = 0; i < keys; i++) {
+    uint64_t key = key_of(i);
+    for (Entry *entry = table[key % buckets]; entry != NULL; entry = entry->next)
+      if (entry->key == key) {
+        found += entry->value == (uint64_t)i;
+        break;
+      }
+  }
+  return found;
+}
+
+static int build_persistent(const char *path, long keys) {
+  MyPHeap *heap = my_pheap_open(path, (keys * 2 + 1) * 32 + (1 << 20), NULL);
+  CHECK_NULL(heap);
+  PIndex *index = my_pheap_malloc(heap, sizeof(PIndex) + keys * sizeof(uint64_t));
+  CHECK_NULL(index);
+  index->buckets = keys;
+  for (long b = 0; b < keys; b++)
+    index->table[b] = 0;
+  for (long i = 0; i < keys; i++) {
+    PEntry *entry = my_pheap_malloc(heap, sizeof(PEntry));
+    CHECK_NULL(entry);
+    entry->key = key_of(i);
+    entry->value = i;
+    entry->next = index->table[entry->key % keys];
+    index->table[entry->key % keys] = my_pheap_offset(heap, entry);
+  }
+  my_pheap_set_root(heap, index);
+  my_pheap_close(heap);
+  return 0;
+}
+
+static long reopen(const char *path, long keys) {
+  MyPHeap *heap = my_pheap_open(path, 0, NULL);
+  CHECK_NULL(heap);
+  PIndex *index = my_pheap_root(heap);
+  long found = 0;
+  for (long i = 0; i < keys; i++) {
+    uint64_t key = key_of(i);
+    for (PEntry *entry = my_pheap_ptr(heap, index->table[key % index->buckets]); entry != NULL;
+         entry = my_pheap_ptr(heap, entry->next))
+      if (entry->key == key) {
+        found += entry->value == (uint64_t)i;
+        break;
+      }
+  }
+  my_pheap_close(heap);
+  return found;
+}
+
+int main(int argc, char **argv) {
+  long keys = 1000000;
+  const char *path = "/tmp/mypheap.bench";
+  if (argc >= 2)
+    keys = strtol(argv[1], NULL, 0);
+  if (argc >= 3)
+    path = argv[2];
+  if (argc > 3 || keys <= 0) {
+    fprintf(stderr, "%s: [keys] [path]\n", argv[0]);
+    return 1;
+  }
+  unlink(path);
+
+  counters_start();
+  double start = now();
+  long found = rebuild(keys);
+  double rebuild_time = now() - start;
+  counters_stop();
+
+  build_persistent(path, keys);
+  // Restart in a fresh process, so the index is mapped from the file anew
+  int fds[2];
+  assert(pipe(fds) == 0);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // The child inherited the counters, and its counts are added to the
+    // parent's when it exits
+    counters_start();
+    double start = now();
+    long child_found = reopen(path, keys);
+    double time = now() - start;
+    counters_stop();
+    assert(write(fds[1], &time, sizeof(time)) == sizeof(time));
+    _exit(child_found != found);
+  }
+  double restart_time;
+  assert(read(fds[0], &restart_time, sizeof(restart_time)) == sizeof(restart_time));
+  int status;
+  waitpid(pid, &status, 0);
+  unlink(path);
+  printf("%f\n%f\n", rebuild_time, restart_time);
+  counters_report();
+  return found != keys || WEXITSTATUS(status) != 0;
+}
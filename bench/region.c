@@ -0,0 +1,57 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark a region against my_malloc/my_free for request-scoped objects:
+   each "request" allocates a few thousand small objects that all die at the
+   end of the request.
+
+   Usage: region [malloc|region] */
+
+#define NUM_REQUESTS 5000
+#define OBJECTS_PER_REQUEST 2000
+#define MAX_SIZE 128
+
+static void *objects[OBJECTS_PER_REQUEST];
+
+int main(int argc, char **argv) {
+  int use_region = 1;
+  if (argc == 2 && strcmp(argv[1], "malloc") == 0) {
+    use_region = 0;
+  } else if (argc > 2 || (argc == 2 && strcmp(argv[1], "region") != 0)) {
+    fprintf(stderr, "%s: [malloc|region]\n", argv[0]);
+    return 1;
+  }
+
+  Region *region = my_region_create(0);
+  CHECK_NULL(region);
+
+  srand(1);
+  counters_start();
+  clock_t start_t = clock();
+  for (int r = 0; r < NUM_REQUESTS; r++) {
+    for (int i = 0; i < OBJECTS_PER_REQUEST; i++) {
+      size_t size = 1 + rand() % MAX_SIZE;
+      objects[i] = use_region ? my_region_alloc(region, size) : mallocing(size);
+      CHECK_NULL(objects[i]);
+      *(char *)objects[i] = 1;
+    }
+    if (use_region) {
+      my_region_reset(region);
+    } else {
+      for (int i = 0; i < OBJECTS_PER_REQUEST; i++)
+        freeing(objects[i]);
+    }
+  }
+  clock_t end_t = clock();
+  counters_stop();
+  my_region_destroy(region);
+
+  double time_taken = (double)(end_t - start_t) / CLOCKS_PER_SEC;
+  printf("%f\n", time_taken);
+  counters_report();
+  return 0;
+}
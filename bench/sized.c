@@ -0,0 +1,75 @@
+#include "../tests/testing.h"
+#include "counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark sized free against plain free. Each round allocates objects of
+   random sizes and then frees them in a shuffled order; only the frees are
+   timed, each one passing the size the caller already knows. Larger sizes
+   run fewer rounds so the total bytes allocated stay about the same.
+
+   Usage: sized [unsized|sized] [max_size] */
+
+#define NUM_ROUNDS 2000
+#define NUM_OBJECTS 2048
+
+static void *objects[NUM_OBJECTS];
+static size_t sizes[NUM_OBJECTS];
+
+int main(int argc, char **argv) {
+  int sized = 1;
+  long max_size = 512;
+  if (argc >= 2) {
+    if (strcmp(argv[1], "unsized") == 0)
+      sized = 0;
+    else if (strcmp(argv[1], "sized") != 0)
+      argc = 0;
+  }
+  if (argc >= 3)
+    max_size = strtol(argv[2], NULL, 0);
+  if (argc == 0 || argc > 3 || max_size <= 0) {
+    fprintf(stderr, "%s: [unsized|sized] [max_size]\n", argv[0]);
+    return 1;
+  }
+
+  long rounds = NUM_ROUNDS * 512 / max_size;
+  if (rounds < 4)
+    rounds = 4;
+
+  srand(1);
+  clock_t elapsed = 0;
+  for (long round = 0; round < rounds; round++) {
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+      sizes[i] = 1 + rand() % max_size;
+      objects[i] = mallocing(sizes[i]);
+      *(char *)objects[i] = 1;
+    }
+    for (int i = NUM_OBJECTS - 1; i > 0; i--) {
+      int j = rand() % (i + 1);
+      void *p = objects[i];
+      size_t size = sizes[i];
+      objects[i] = objects[j];
+      sizes[i] = sizes[j];
+      objects[j] = p;
+      sizes[j] = size;
+    }
+
+    counters_start();
+    clock_t start_t = clock();
+    if (sized) {
+      for (int i = 0; i < NUM_OBJECTS; i++)
+        my_free_sized(objects[i], sizes[i]);
+    } else {
+      for (int i = 0; i < NUM_OBJECTS; i++)
+        freeing(objects[i]);
+    }
+    elapsed += clock() - start_t;
+    counters_stop();
+  }
+  double time_taken = (double)elapsed / CLOCKS_PER_SEC;
+  printf("%f\n", time_taken);
+  counters_report();
+  return 0;
+}
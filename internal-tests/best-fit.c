@@ -0,0 +1,59 @@
+#include "internal-tests.h"
+
+/** This test checks that the best-fit policy stays true best fit with many
+ *  free fragments, both in the small bins and in the tree of large blocks. It
+ *  frees fragments of distinct sizes, kept apart by live separators, and then
+ *  asks for each one in a scrambled order with a request just small enough
+ *  that no other fragment fits better.
+ *
+ *  In a hardened build freed blocks sit in the quarantine first, so the test
+ *  trivially passes.
+ */
+
+#ifndef ENABLE_HARDENED
+
+#define FRAGMENTS 112
+
+int main(int argc, char const *argv[]) {
+  setenv("MYMALLOC_POLICY", "best", 1);
+
+  static void *fragments[FRAGMENTS];
+  static void *separators[FRAGMENTS];
+  static size_t sizes[FRAGMENTS];
+
+  // Half the fragments are small enough for the bins, half go in the tree
+  for (int i = 0; i < FRAGMENTS; i++) {
+    size_t step = (size_t)(i / 2 * 29 % (FRAGMENTS / 2)) * 16;
+    sizes[i] = i % 2 ? 4000 + step : 64 + step;
+    fragments[i] = my_malloc(sizes[i]);
+    separators[i] = my_malloc(8);
+    if (fragments[i] == NULL || separators[i] == NULL) {
+      ILOG("my_malloc returned NULL\n");
+      return 1;
+    }
+  }
+  for (int i = 0; i < FRAGMENTS; i++) {
+    my_free(fragments[i]);
+  }
+
+  for (int k = 0; k < FRAGMENTS; k++) {
+    int i = (k * 37) % FRAGMENTS;
+    // Sizes are 16 bytes apart, and a block is never split into a remainder
+    // smaller than a header
+    void *p = my_malloc(sizes[i] - 8);
+    if (p != fragments[i]) {
+      ILOG("request for %zu bytes got %p, best fit is %p\n", sizes[i] - 8, p,
+           fragments[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#else
+
+int main(int argc, char const *argv[]) {
+  return 0;
+}
+
+#endif
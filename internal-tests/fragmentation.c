@@ -2,6 +2,7 @@
 #include <stdlib.h> /* Defines rand, srand */
 #include <time.h>   /* Defines time */
 #include <stdio.h>  /* Defines printf */
+#include <string.h> /* Defines strcmp */
 
 /** Starting code for writing tests that measure memory fragmentation.
  *  Note that the CI will not run this test intentionally.
@@ -12,18 +13,70 @@
 #define REPTS 1000
 #define NUM_PTRS 100
 #define MAX_ALLOC_SIZE 4096
+// Mixed trace: temporaries allocated and freed by each request, and cache
+// entries that live until a later request evicts them
+#define MAX_TEMPS 64
+#define CACHE_SLOTS 2000
+#define MAX_ENTRY_SIZE 512
 
 char *ptrs[NUM_PTRS];
 size_t sizes[NUM_PTRS];       // Added to store sizes of allocations
 
 size_t current_payload = 0;   // Added to track current aggregate payload (Pk)
 size_t max_payload = 0;       // Added to track maximum aggregate payload (max Pi)
+size_t max_extent = 0;        // Highest end of the carved heap, in bytes
+int repts = REPTS;
 
 /* Forward declarations of functions from mymalloc.c */
 void *my_malloc(size_t size);
 void my_free(void *ptr);
 size_t get_heap_size();        // Function to get current heap size (Hk)
 
+/* Bytes carved out of the first arena: every block before the wilderness,
+ * which is always the last block. The heap size only moves in whole commit
+ * chunks, so this is the finer measure when comparing placement policies. */
+size_t heap_extent() {
+    size_t extent = 0;
+    for (Block *b = get_start_block(); b != NULL; b = get_next_block(b)) {
+        if (get_next_block(b) != NULL) {
+            extent += block_size(b);
+        }
+    }
+    return extent;
+}
+
+/* Bytes carved out of every arena, for traces that use more than one */
+size_t arenas_extent() {
+    MyHeapSegment segments[64];
+    size_t n = my_heap_segments(segments, 64);
+    size_t extent = 0;
+    for (size_t i = 0; i < n && i < 64; i++) {
+        if (!segments[i].mapped) {
+            extent += segments[i].end - (char *)segments[i].first;
+        }
+    }
+    return extent;
+}
+
+/* Free blocks below the top of every arena: how many, their bytes, and the
+ * largest. Free space left in holes between live blocks is what segregating
+ * lifetimes is meant to avoid. */
+void count_holes(size_t *holes, size_t *bytes, size_t *largest) {
+    MyHeapSegment segments[64];
+    size_t n = my_heap_segments(segments, 64);
+    *holes = *bytes = *largest = 0;
+    for (size_t i = 0; i < n && i < 64; i++) {
+        if (segments[i].mapped) continue;
+        for (char *p = (char *)segments[i].first; p < segments[i].end; p += block_size((Block *)p)) {
+            if (is_free((Block *)p)) {
+                (*holes)++;
+                *bytes += block_size((Block *)p);
+                if (block_size((Block *)p) > *largest) *largest = block_size((Block *)p);
+            }
+        }
+    }
+}
+
 /* Returns a random number between min and max (inclusive) */
 int random_in_range(int min, int max) {
     return min + rand() / (RAND_MAX / (max - min + 1) + 1);
@@ -31,7 +84,7 @@ int random_in_range(int min, int max) {
 
 /* Performs REPTS number of calls to my_malloc/my_free. */
 void random_allocations() {
-    for (int i = 0; i < REPTS; i++) {
+    for (int i = 0; i < repts; i++) {
         int idx = random_in_range(0, NUM_PTRS - 1);
         if (ptrs[idx] == NULL) {
             size_t random_size = (size_t)random_in_range(1, MAX_ALLOC_SIZE); // Avoid size 0 allocations
@@ -41,6 +94,10 @@ void random_allocations() {
             if (current_payload > max_payload) {
                 max_payload = current_payload;
             }
+            size_t extent = heap_extent();
+            if (extent > max_extent) {
+                max_extent = extent;
+            }
         } else {
             my_free(ptrs[idx]);
             current_payload -= sizes[idx];
@@ -50,11 +107,57 @@ void random_allocations() {
     }
 }
 
+/* Performs REPTS requests of a service with a cache: each allocates a burst
+ * of temporaries, sometimes replaces a cache entry, and frees its
+ * temporaries. With `hinted`, temporaries and cache entries are allocated
+ * with their lifetime hints. */
+void mixed_allocations(int hinted) {
+    static char *cache[CACHE_SLOTS];
+    static size_t cache_sizes[CACHE_SLOTS];
+    char *temps[MAX_TEMPS];
+    size_t temp_sizes[MAX_TEMPS];
+    unsigned short_hint = hinted ? MY_HINT_SHORT_LIVED : 0;
+    unsigned long_hint = hinted ? MY_HINT_LONG_LIVED : 0;
+
+    for (int r = 0; r < repts; r++) {
+        int n = random_in_range(1, MAX_TEMPS);
+        for (int i = 0; i < n; i++) {
+            temp_sizes[i] = (size_t)random_in_range(16, MAX_ALLOC_SIZE);
+            temps[i] = my_malloc_hint(temp_sizes[i], short_hint);
+            current_payload += temp_sizes[i];
+            if (random_in_range(0, 3) == 0) {
+                int slot = random_in_range(0, CACHE_SLOTS - 1);
+                if (cache[slot] != NULL) {
+                    my_free(cache[slot]);
+                    current_payload -= cache_sizes[slot];
+                }
+                cache_sizes[slot] = (size_t)random_in_range(32, MAX_ENTRY_SIZE);
+                cache[slot] = my_malloc_hint(cache_sizes[slot], long_hint);
+                current_payload += cache_sizes[slot];
+            }
+        }
+        if (current_payload > max_payload) {
+            max_payload = current_payload;
+        }
+        size_t extent = arenas_extent();
+        if (extent > max_extent) {
+            max_extent = extent;
+        }
+        for (int i = 0; i < n; i++) {
+            my_free(temps[i]);
+            current_payload -= temp_sizes[i];
+        }
+    }
+}
+
 /* Usage: passing an unsigned integer as the first argument will use that value
  * to seed the pRNG. This will allow you to re-run the same sequence of calls to
  * my_malloc and my_free for the purposes of debugging or measuring
  * fragmentation.
  * If a seed is not given to the program, it will use the current time instead.
+ * An optional second argument sets the number of calls (default REPTS). A
+ * third argument of "mixed" or "hinted" runs that many requests of the mixed
+ * trace instead, without or with lifetime hints.
  */
 int main(int argc, char const *argv[]) {
     unsigned int seed;
@@ -63,6 +166,9 @@ int main(int argc, char const *argv[]) {
     } else {
         sscanf(argv[1], "%u", &seed);
     }
+    if (argc >= 3) {
+        sscanf(argv[2], "%d", &repts);
+    }
     fprintf(stderr, "Running fragmentation test with random seed: %u\n", seed);
     srand(seed);
 
@@ -71,7 +177,12 @@ int main(int argc, char const *argv[]) {
         sizes[i] = 0;
     }
 
-    random_allocations();
+    int mixed = argc >= 4;
+    if (mixed) {
+        mixed_allocations(strcmp(argv[3], "hinted") == 0);
+    } else {
+        random_allocations();
+    }
 
     /* Measure and report peak memory utilization */
     size_t Hk = get_heap_size();  // Get current heap size from allocator
@@ -83,5 +194,16 @@ int main(int argc, char const *argv[]) {
     printf("Current heap size (Hk): %zu bytes\n", Hk);
     printf("Peak memory utilization (Uk): %.4f%%\n", Uk * 100.0);
 
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    printf("Placement policy: %s\n", stats.policy);
+    printf("Peak heap extent: %zu bytes\n", max_extent);
+    printf("Peak extent utilization: %.4f%%\n", (double)max_Pi / (double)max_extent * 100.0);
+    if (mixed) {
+        size_t holes, bytes, largest;
+        count_holes(&holes, &bytes, &largest);
+        printf("Free space in holes: %zu bytes in %zu blocks, largest %zu\n", bytes, holes, largest);
+    }
+
     return 0;
 }
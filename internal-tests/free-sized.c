@@ -0,0 +1,78 @@
+#include "internal-tests.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** This test frees small, large and directly mapped blocks with
+ *  `my_free_sized` and checks they are returned just like `my_free` would
+ *  return them. In debug and hardened builds, a size too large or too small
+ *  for the block must abort.
+ */
+
+#if defined(ENABLE_DEBUG) || defined(ENABLE_HARDENED)
+
+static void wrong_size(void) {
+  void *p = my_malloc(64);
+  my_free_sized(p, 1 << 20);
+}
+
+static void undersized(void) {
+  void *p = my_malloc(4096);
+  my_free_sized(p, 1);
+}
+
+static void mapped_as_small(void) {
+  void *p = my_malloc(100 << 20);
+  my_free_sized(p, 64);
+}
+
+static int expect_abort(const char *name, void (*scenario)(void)) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    scenario();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+    ILOG("%s was not detected\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+#endif
+
+int main(int argc, char const *argv[]) {
+  static const size_t sizes[] = {1, 24, 100, 4096, 200 << 10, 100 << 20};
+  const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+  void *ptrs[sizeof(sizes) / sizeof(sizes[0])];
+
+  for (int round = 0; round < 3; round++) {
+    for (size_t i = 0; i < count; i++) {
+      ptrs[i] = my_malloc(sizes[i]);
+      assert(ptrs[i] != NULL);
+      memset(ptrs[i], 0xAB, sizes[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+      my_free_sized(ptrs[i], sizes[i]);
+    }
+
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    if (stats.current_usage != 0) {
+      ILOG("%zu bytes still in use after sized frees\n", stats.current_usage);
+      return 1;
+    }
+  }
+  my_free_sized(NULL, 8);
+
+  int ok = 1;
+#if defined(ENABLE_DEBUG) || defined(ENABLE_HARDENED)
+  ok &= expect_abort("sized free with the wrong size", wrong_size);
+  ok &= expect_abort("sized free with a size far too small", undersized);
+  ok &= expect_abort("mapped block freed as small", mapped_as_small);
+#endif
+  return ok ? 0 : 1;
+}
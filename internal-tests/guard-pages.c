@@ -0,0 +1,66 @@
+#include "internal-tests.h"
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** This test checks the guard page build (`make GUARD_PAGES=1`). A large
+ *  block's payload must end flush against an inaccessible page, so writing one
+ *  byte past it faults, and a freed large block must stay inaccessible for a
+ *  while instead of being unmapped. Each scenario runs in a child process that
+ *  is expected to fault; the sanitizer build turns the fault into a non-zero
+ *  exit instead of a signal. In a normal build the test trivially passes.
+ */
+
+#ifdef ENABLE_GUARD_PAGES
+
+#define LARGE_SIZE (1 << 20)
+
+static void overrun(void) {
+  char *p = my_malloc(LARGE_SIZE);
+  memset(p, 'A', LARGE_SIZE);
+  p[LARGE_SIZE] = 'A';
+}
+
+static void use_after_free(void) {
+  char *p = my_malloc(LARGE_SIZE);
+  my_free(p);
+  p[0] = 'A';
+}
+
+static int expect_fault(const char *name, void (*scenario)(void)) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    scenario();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    ILOG("%s did not fault\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char const *argv[]) {
+  // Filling a large block exactly must not fault
+  for (int i = 0; i < 128; i++) {
+    size_t size = LARGE_SIZE + i * sizeof(size_t);
+    char *p = my_malloc(size);
+    memset(p, 0xFF, size);
+    my_free(p);
+  }
+
+  int ok = 1;
+  ok &= expect_fault("overrun into guard page", overrun);
+  ok &= expect_fault("use after free", use_after_free);
+  return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char const *argv[]) {
+  return 0;
+}
+
+#endif
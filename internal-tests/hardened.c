@@ -0,0 +1,79 @@
+#include "internal-tests.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** This test checks the hardened build (`make HARDENED=1`) catches heap
+ *  corruption. Each scenario runs in a child process that is expected to be
+ *  killed by SIGABRT. In a normal build the checks are compiled out and the
+ *  test trivially passes.
+ */
+
+#ifdef ENABLE_HARDENED
+
+static void overflow(void) {
+  char *p = my_malloc(24);
+  memset(p, 'A', 25);
+  my_free(p);
+}
+
+static void double_free(void) {
+  void *p = my_malloc(64);
+  my_free(p);
+  my_free(p);
+}
+
+static void interior_free(void) {
+  char *p = my_malloc(64);
+  my_free(p + 16);
+}
+
+static void write_after_free(void) {
+  char *p = my_malloc(64);
+  my_free(p);
+  p[8] = 'A';
+  // Push enough blocks through the quarantine to evict `p`
+  for (int i = 0; i < 1024; i++) {
+    my_free(my_malloc(64));
+  }
+}
+
+static int expect_abort(const char *name, void (*scenario)(void)) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    scenario();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+    ILOG("%s was not detected\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char const *argv[]) {
+  // A correct program must run cleanly
+  for (int i = 0; i < 1024; i++) {
+    char *p = my_malloc(i + 1);
+    memset(p, 0xFF, i + 1);
+    my_free(p);
+  }
+
+  int ok = 1;
+  ok &= expect_abort("heap buffer overflow", overflow);
+  ok &= expect_abort("double free", double_free);
+  ok &= expect_abort("interior pointer free", interior_free);
+  ok &= expect_abort("write after free", write_after_free);
+  return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char const *argv[]) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "internal-tests.h"
+#include <stdint.h>
+
+/** This test interleaves allocations with different placement hints and
+ *  checks each hint class gets address ranges of its own, apart from each
+ *  other and from unhinted blocks. Once every short-lived block is freed,
+ *  their arena must have coalesced back into one free region, so a block as
+ *  large as all of them together lands where the first one was.
+ *
+ *  In a hardened build freed blocks sit in the quarantine first, so the
+ *  coalescing is not checked.
+ */
+
+#define PAIRS 1000
+#define SIZE 100
+
+enum { SHORT, LONG, HOT, PLAIN, CLASSES };
+
+static const unsigned hints[CLASSES] = {MY_HINT_SHORT_LIVED, MY_HINT_LONG_LIVED, MY_HINT_HOT, 0};
+static const char *names[CLASSES] = {"short-lived", "long-lived", "hot", "unhinted"};
+
+static void *blocks[CLASSES][PAIRS];
+static uintptr_t low[CLASSES], high[CLASSES];
+
+int main(void) {
+  for (int c = 0; c < CLASSES; c++) {
+    low[c] = UINTPTR_MAX;
+  }
+  for (int i = 0; i < PAIRS; i++) {
+    for (int c = 0; c < CLASSES; c++) {
+      blocks[c][i] = my_malloc_hint(SIZE, hints[c]);
+      assert(blocks[c][i] != NULL);
+      uintptr_t p = (uintptr_t)blocks[c][i];
+      if (p < low[c]) low[c] = p;
+      if (p > high[c]) high[c] = p;
+    }
+  }
+
+  for (int a = 0; a < CLASSES; a++) {
+    for (int b = a + 1; b < CLASSES; b++) {
+      if (low[a] <= high[b] && low[b] <= high[a]) {
+        ILOG("%s and %s blocks are mixed\n", names[a], names[b]);
+        return 1;
+      }
+    }
+  }
+
+  // The conflicting hints resolve to short-lived
+  void *both = my_malloc_hint(SIZE, MY_HINT_HOT | MY_HINT_SHORT_LIVED);
+  if ((uintptr_t)both <= high[LONG] && (uintptr_t)both >= low[LONG]) {
+    ILOG("a short-lived hot block went to the long-lived arena\n");
+    return 1;
+  }
+  my_free(both);
+
+#ifndef ENABLE_HARDENED
+  for (int i = 0; i < PAIRS; i++) {
+    my_free(blocks[SHORT][i]);
+  }
+  void *all = my_malloc_hint(PAIRS * SIZE, MY_HINT_SHORT_LIVED);
+  if ((uintptr_t)all != low[SHORT]) {
+    ILOG("freed short-lived blocks did not coalesce: got %p, expected %p\n", all,
+         (void *)low[SHORT]);
+    return 1;
+  }
+#endif
+  return 0;
+}
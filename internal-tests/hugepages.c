@@ -0,0 +1,151 @@
+#include "internal-tests.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/** This test checks the huge page build (`make HUGEPAGES=1`). Every arena
+ *  must start on a 2 MB boundary and be backed either by MAP_HUGETLB or by a
+ *  mapping advised with MADV_HUGEPAGE, which /proc/self/smaps lists as the
+ *  "ht" or "hg" VmFlags. A request of 64 KB or more served from a free block
+ *  must be carved from the block's tail, leaving the front for small objects,
+ *  and must not straddle a huge page boundary even when the block ends just
+ *  past one. In other builds the test trivially passes.
+ */
+
+#ifdef ENABLE_HUGEPAGES
+
+#define HUGE_PAGE (2ul << 20)
+#define BLOCK_OVERHEAD (kMetadataSize + sizeof(size_t))
+#define RUN_BLOCKS 64
+#define RUN_BLOCK_SIZE (100 << 10)
+// The free run ends this far past a huge page boundary
+#define PAST_BOUNDARY (16 << 10)
+#define TAIL_SIZE (64 << 10)
+// Enough 100 KB blocks to fill three 8 MB arenas
+#define FILL_BLOCKS 256
+
+// Whether the mapping holding `addr` is hugetlb or advised for huge pages.
+// Returns 1 when the kernel has no transparent huge pages to advise for.
+static int huge_backed(void *addr) {
+  FILE *thp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (thp == NULL) return 1;
+  fclose(thp);
+
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL) return 1;
+  char line[512];
+  int inside = 0, backed = 0;
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    unsigned long start, end;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+      inside = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+    } else if (inside && strncmp(line, "VmFlags:", 8) == 0) {
+      backed = strstr(line, " ht") != NULL || strstr(line, " hg") != NULL;
+      break;
+    }
+  }
+  fclose(smaps);
+  return backed;
+}
+
+static int check_arenas(void) {
+  MyHeapSegment segments[64];
+  size_t n = my_heap_segments(segments, 64);
+  size_t arenas = 0;
+  for (size_t i = 0; i < n && i < 64; i++) {
+    if (segments[i].mapped) continue;
+    arenas++;
+    char *start = (char *)segments[i].first - kMetadataSize;
+    if ((uintptr_t)start % HUGE_PAGE != 0) {
+      ILOG("arena at %p is not aligned to a huge page\n", start);
+      return 0;
+    }
+    if (!huge_backed(start)) {
+      ILOG("arena at %p is neither hugetlb nor advised for huge pages\n", start);
+      return 0;
+    }
+  }
+  if (arenas < 3) {
+    ILOG("expected at least 3 arenas, found %zu\n", arenas);
+    return 0;
+  }
+  return 1;
+}
+
+#ifndef ENABLE_HARDENED
+// Where the arena will carve its next block
+static char *next_carve(void) {
+  void *probe = my_malloc(16);
+  char *next = (char *)ptr_to_block(probe);
+  my_free(probe);
+  return next;
+}
+
+static int check_tail(void) {
+  // Carve blocks up to PAST_BOUNDARY bytes past a huge page boundary, so a
+  // tail cut flush against the end of the run they free into would straddle
+  // the boundary
+  char *first = next_carve();
+  char *run_end = (char *)(((uintptr_t)first + 2 * HUGE_PAGE) & ~(HUGE_PAGE - 1)) + PAST_BOUNDARY;
+  void *run[RUN_BLOCKS];
+  size_t n = 0;
+  char *next;
+  while ((next = next_carve()) < run_end && n < RUN_BLOCKS) {
+    size_t left = run_end - next - BLOCK_OVERHEAD;
+    size_t size = left <= RUN_BLOCK_SIZE ? left : left <= 2 * RUN_BLOCK_SIZE ? left / 2 : RUN_BLOCK_SIZE;
+    run[n++] = my_malloc(size);
+  }
+  void *pin = my_malloc(16);
+  if ((char *)ptr_to_block(pin) != run_end) {
+    ILOG("the run ends at %p, not %p\n", ptr_to_block(pin), run_end);
+    return 0;
+  }
+  for (size_t i = 0; i < n; i++) {
+    my_free(run[i]);
+  }
+
+  char *tail = my_malloc(TAIL_SIZE);
+  if (tail <= first + kMetadataSize || tail + TAIL_SIZE > run_end) {
+    ILOG("a %d byte request was not carved from the tail of the free run\n", TAIL_SIZE);
+    return 0;
+  }
+  if ((uintptr_t)tail / HUGE_PAGE != ((uintptr_t)tail + TAIL_SIZE - 1) / HUGE_PAGE) {
+    ILOG("a %d byte tail at %p straddles a huge page boundary\n", TAIL_SIZE, tail);
+    return 0;
+  }
+  memset(tail, 0x5A, TAIL_SIZE);
+  my_free(tail);
+  my_free(pin);
+  return 1;
+}
+#endif
+
+int main(int argc, char const *argv[]) {
+  setenv("MYMALLOC_ARENA_SIZE", "8M", 1);
+
+#ifndef ENABLE_HARDENED
+  // The quarantine keeps freed blocks from coalescing into a run, so this
+  // only runs in the plain build
+  if (!check_tail()) return 1;
+#endif
+
+  // Far more than one arena holds, so more have to be reserved. This comes
+  // last: allocations try the newest arena first.
+  static void *fill[FILL_BLOCKS];
+  for (int i = 0; i < FILL_BLOCKS; i++) {
+    fill[i] = my_malloc(RUN_BLOCK_SIZE);
+  }
+  if (!check_arenas()) return 1;
+  for (int i = 0; i < FILL_BLOCKS; i++) {
+    my_free(fill[i]);
+  }
+  return 0;
+}
+
+#else
+
+int main(int argc, char const *argv[]) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "internal-tests.h"
+
+/** This test checks that arenas are reserved up front but only committed as
+ *  the heap grows, and that the heap keeps growing by reserving more arenas.
+ *  It shrinks arenas to 1 MB with MYMALLOC_ARENA_SIZE so growth is quick.
+ *
+ *  If you are failing this test, check that the top (wilderness) block is
+ *  carved incrementally and that a new arena is reserved when all are full.
+ */
+
+#ifdef ENABLE_HUGEPAGES
+// Arenas and commits are rounded up to whole 2 MB huge pages
+#define ARENA_SIZE (2 << 20)
+#define MAX_INITIAL_COMMIT (2 << 20)
+#else
+#define ARENA_SIZE (1 << 20)
+#define MAX_INITIAL_COMMIT (256 << 10)
+#endif
+#define NALLOCS 64
+#define ALLOC_SIZE (100 << 10)
+
+int main(int argc, char const *argv[]) {
+  setenv("MYMALLOC_ARENA_SIZE", "1M", 1);
+
+  void *first = my_malloc(16);
+  if (first == NULL) {
+    ILOG("my_malloc unexpectedly returned NULL.\n");
+    return 1;
+  }
+  if (get_heap_reserved_size() != ARENA_SIZE) {
+    ILOG("Expected %d bytes reserved, got %zu\n", ARENA_SIZE, get_heap_reserved_size());
+    return 1;
+  }
+  if (get_heap_size() > MAX_INITIAL_COMMIT) {
+    ILOG("A single small allocation committed %zu bytes\n", get_heap_size());
+    return 1;
+  }
+
+  // Far more than one arena holds
+  void *ptrs[NALLOCS];
+  for (int i = 0; i < NALLOCS; i++) {
+    ptrs[i] = my_malloc(ALLOC_SIZE);
+    if (ptrs[i] == NULL) {
+      ILOG("my_malloc returned NULL after %d allocations\n", i);
+      return 1;
+    }
+  }
+  if (get_heap_reserved_size() < (size_t)NALLOCS * ALLOC_SIZE) {
+    ILOG("Heap did not grow: %zu bytes reserved\n", get_heap_reserved_size());
+    return 1;
+  }
+  if (get_heap_size() > get_heap_reserved_size()) {
+    ILOG("Committed %zu bytes exceeds reserved %zu\n", get_heap_size(),
+         get_heap_reserved_size());
+    return 1;
+  }
+
+#ifndef ENABLE_HARDENED
+  // Freed space is reused rather than growing the heap again. Hardened builds
+  // hold freed blocks in quarantine, so they may legitimately grow here.
+  size_t reserved = get_heap_reserved_size();
+  for (int i = 0; i < NALLOCS; i++) {
+    my_free(ptrs[i]);
+  }
+  for (int i = 0; i < NALLOCS; i++) {
+    ptrs[i] = my_malloc(ALLOC_SIZE);
+  }
+  if (get_heap_reserved_size() != reserved) {
+    ILOG("Heap grew from %zu to %zu bytes despite free space\n", reserved,
+         get_heap_reserved_size());
+    return 1;
+  }
+#endif
+
+  // A directly mapped block is given back in full when it is freed. Guard
+  // page builds keep the address space of a freed mapping for a while.
+  size_t committed = get_heap_size();
+  size_t reserved_before = get_heap_reserved_size();
+  void *large = my_malloc(4 << 20);
+  if (get_heap_reserved_size() <= reserved_before) {
+    ILOG("Mapping a large block reserved nothing\n");
+    return 1;
+  }
+  my_free(large);
+  if (get_heap_size() != committed) {
+    ILOG("Committed %zu bytes after freeing a large block, %zu before\n", get_heap_size(),
+         committed);
+    return 1;
+  }
+#ifndef ENABLE_GUARD_PAGES
+  if (get_heap_reserved_size() != reserved_before) {
+    ILOG("Reserved %zu bytes after freeing a large block, %zu before\n",
+         get_heap_reserved_size(), reserved_before);
+    return 1;
+  }
+#endif
+  return 0;
+}
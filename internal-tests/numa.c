@@ -0,0 +1,68 @@
+#include "internal-tests.h"
+#include <pthread.h>
+
+/** This test checks NUMA-aware arena placement using the fake topology
+ *  override. With MYMALLOC_FAKE_NUMA=2 the main thread is assigned node 0 and
+ *  the next thread node 1, so their allocations must come from different
+ *  arenas and show up under different nodes in the stats.
+ *
+ *  If you are failing this test, check that arenas are picked by the calling
+ *  thread's node and that per-node usage is updated on malloc and free.
+ */
+
+#define SMALL_SIZE 100
+#define LARGE_SIZE (80 << 20)
+
+static void *small_on_thread;
+static void *large_on_thread;
+
+static void *allocate_on_other_node(void *arg) {
+  small_on_thread = my_malloc(SMALL_SIZE);
+  large_on_thread = my_malloc(LARGE_SIZE);
+  return NULL;
+}
+
+int main(int argc, char const *argv[]) {
+  setenv("MYMALLOC_FAKE_NUMA", "2", 1);
+
+  char *small_on_main = my_malloc(SMALL_SIZE);
+  pthread_t thread;
+  pthread_create(&thread, NULL, allocate_on_other_node, NULL);
+  pthread_join(thread, NULL);
+
+  if (small_on_main == NULL || small_on_thread == NULL || large_on_thread == NULL) {
+    ILOG("my_malloc unexpectedly returned NULL.\n");
+    return 1;
+  }
+
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (stats.numa_nodes != 2) {
+    ILOG("Expected 2 NUMA nodes, got %d\n", stats.numa_nodes);
+    return 1;
+  }
+  if (stats.node_usage[0] < SMALL_SIZE ||
+      stats.node_usage[1] < SMALL_SIZE + LARGE_SIZE) {
+    ILOG("Unexpected per-node usage: node 0 %zu, node 1 %zu\n",
+         stats.node_usage[0], stats.node_usage[1]);
+    return 1;
+  }
+
+  // The two small blocks live in different arenas, which are kMemorySize apart
+  size_t distance = small_on_main > (char *)small_on_thread
+                        ? small_on_main - (char *)small_on_thread
+                        : (char *)small_on_thread - small_on_main;
+  if (distance < kMemorySize - 2 * kMetadataSize) {
+    ILOG("Blocks for different nodes came from the same arena\n");
+    return 1;
+  }
+
+  my_free(small_on_thread);
+  my_free(large_on_thread);
+  my_malloc_stats(&stats);
+  if (stats.node_usage[1] != 0) {
+    ILOG("Node 1 usage should be 0 after freeing, got %zu\n", stats.node_usage[1]);
+    return 1;
+  }
+  return 0;
+}
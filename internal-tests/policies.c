@@ -0,0 +1,137 @@
+#include "internal-tests.h"
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** This test runs each placement policy (MYMALLOC_POLICY) in a child process.
+ *  It frees fragments of a few sizes, kept apart by live separators, and
+ *  checks the policy picks the block it should. The children then churn
+ *  random allocations to check the policy's index stays consistent.
+ *
+ *  In a hardened build freed blocks sit in the quarantine first, so only the
+ *  churn is checked. A last child passes a misspelled name, which should warn
+ *  and fall back to best fit.
+ */
+
+#define FRAGMENTS 8
+#define CHURN_SLOTS 512
+
+#ifndef ENABLE_HARDENED
+// Payload sizes of the fragments, in address order
+static const size_t sizes[FRAGMENTS] = {2000, 600, 1500, 5000, 1500, 600, 300, 200};
+
+static void *fragments[FRAGMENTS];
+
+static void make_fragments(void) {
+  for (int i = 0; i < FRAGMENTS; i++) {
+    fragments[i] = my_malloc(sizes[i]);
+    my_malloc(8);
+  }
+  for (int i = 0; i < FRAGMENTS; i++) {
+    my_free(fragments[i]);
+  }
+}
+
+static int expect(const char *policy, void *p, int fragment) {
+  if (p != fragments[fragment]) {
+    ILOG("%s: expected fragment %d (%p), got %p\n", policy, fragment,
+         fragments[fragment], p);
+    return 0;
+  }
+  return 1;
+}
+#endif
+
+static int check_placement(const char *policy) {
+#ifdef ENABLE_HARDENED
+  return 1;
+#else
+  make_fragments();
+  // Requests leave remainders too small for the requests that follow
+  if (strcmp(policy, "best") == 0) {
+    return expect(policy, my_malloc(1450), 2) && expect(policy, my_malloc(1450), 4) &&
+           expect(policy, my_malloc(250), 6);
+  } else if (strcmp(policy, "first") == 0) {
+    return expect(policy, my_malloc(1450), 0) && expect(policy, my_malloc(1450), 2) &&
+           expect(policy, my_malloc(4900), 3);
+  } else if (strcmp(policy, "next") == 0) {
+    // The search resumes at the last block handed out and wraps around
+    return expect(policy, my_malloc(1450), 0) && expect(policy, my_malloc(4900), 3) &&
+           expect(policy, my_malloc(1450), 4) && expect(policy, my_malloc(1450), 2);
+  } else {
+    // The most recent free wastes under 1/8 of the request and is taken
+    // before the best fit; nothing but fragment 3 fits 4000 bytes
+    return expect(policy, my_malloc(1400), 4) && expect(policy, my_malloc(4000), 3);
+  }
+#endif
+}
+
+static int churn(const char *policy) {
+  MallocStats before;
+  my_malloc_stats(&before);
+
+  static char *slots[CHURN_SLOTS];
+  static size_t slot_sizes[CHURN_SLOTS];
+  srand(7);
+  for (int i = 0; i < 20000; i++) {
+    int slot = rand() % CHURN_SLOTS;
+    if (slots[slot] != NULL) {
+      for (size_t j = 0; j < slot_sizes[slot]; j += 64) {
+        if (slots[slot][j] != (char)slot) {
+          ILOG("%s: slot %d was overwritten\n", policy, slot);
+          return 0;
+        }
+      }
+      my_free(slots[slot]);
+    }
+    slot_sizes[slot] = 1 + rand() % (rand() % 8 == 0 ? 20000 : 300);
+    slots[slot] = my_malloc(slot_sizes[slot]);
+    memset(slots[slot], slot, slot_sizes[slot]);
+  }
+  for (int i = 0; i < CHURN_SLOTS; i++) {
+    my_free(slots[i]);
+  }
+
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (strcmp(stats.policy, policy) != 0 || stats.current_usage != before.current_usage) {
+    ILOG("%s: stats report policy %s with %zu bytes leaked\n", policy,
+         stats.policy, stats.current_usage - before.current_usage);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char const *argv[]) {
+  static const char *policies[] = {"best", "first", "next", "good"};
+  int ok = 1;
+  for (int i = 0; i < 4; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      setenv("MYMALLOC_POLICY", policies[i], 1);
+      _exit(check_placement(policies[i]) && churn(policies[i]) ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      ILOG("%s policy failed\n", policies[i]);
+      ok = 0;
+    }
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    setenv("MYMALLOC_POLICY", "nxt", 1);
+    my_free(my_malloc(8));
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    _exit(strcmp(stats.policy, "best") == 0 ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    ILOG("unknown policy did not fall back to best fit\n");
+    ok = 0;
+  }
+  return ok ? 0 : 1;
+}
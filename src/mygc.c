@@ -1,37 +1,1050 @@
+#define _GNU_SOURCE
 #include "mygc.h"
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Conservative mark-sweep collector over the mymalloc heap.
+ *
+ * Every word of the roots (the calling thread's stack and registers, every
+ * thread's cache, and the ranges and slots registered with my_gc_add_roots and
+ * my_gc_add_root) and of every marked block other than an atomic one is
+ * treated as a possible pointer; pointers into the middle of a payload keep
+ * the block alive. Marking runs on
+ * a pool of helper threads with work stealing, and the sweep is split over
+ * disjoint ranges of the heap. The heap lock is held from the start of the
+ * collection until the garbage has been found, so the heap cannot change under
+ * the walk. Only the calling thread's stack is scanned: other threads must
+ * not hold the only pointer to a block while it collects.
+ *
+ * Objects from my_gc_alloc live in a nursery of fixed-size chunks in a
+ * mapping of its own. A minor collection marks from the roots and the dirty
+ * cards, follows pointers into young chunks only, and then resets every young
+ * chunk with no survivors. Conservative roots cannot be rewritten, so
+ * survivors are never moved: a chunk holding any is promoted in place and
+ * becomes old, and only a full collection frees its objects.
+ */
+
+// Most threads a collection uses, the calling thread included
+#define MAX_GC_THREADS 32
+// Payload ranges longer than this are scanned in pieces, so idle threads can
+// steal the rest of a large block
+#define SCAN_CHUNK (16 << 10)
+// Bitmap words a sweep task covers: 64 granules per word, so 2 MB of heap
+#define SWEEP_WORDS 4096
+// A thread offers half of its mark stack to thieves once it holds this many
+// entries and its shared stack has run dry
+#define SHARE_THRESHOLD 64
+// Granule the side tables track; blocks start on word boundaries
+#define GRANULE sizeof(size_t)
+// Nursery chunk size, the largest object the nursery takes, and the default
+// nursery size (MYMALLOC_NURSERY_SIZE)
+#define NURSERY_CHUNK (256 << 10)
+#define NURSERY_MAX_OBJECT (NURSERY_CHUNK / 8)
+#define NURSERY_SIZE (32 << 20)
+// Side table words per nursery chunk
+#define CHUNK_WORDS (NURSERY_CHUNK / GRANULE / 64)
+// Header bit of a nursery object whose contents are not scanned
+#define NOSCAN_FLAG 0x1
 
 static void *start_of_stack = NULL;
 
-// Word alignment
-const size_t kAlignment = sizeof(size_t);
-// Minimum allocation size (1 word)
-const size_t kMinAllocationSize = kAlignment;
-// Size of meta-data per Block
-const size_t kMetadataSize = sizeof(Block);
-// Maximum allocation size (128 MB)
-const size_t kMaxAllocationSize = (128ull << 20) - kMetadataSize;
-// Memory size that is mmapped (64 MB)
-const size_t kMemorySize = (64ull << 20);
+// A range of words to scan for pointers
+typedef struct {
+  char *from;
+  char *to;
+} Work;
 
-// Call this function in your test code (at the start of main)
-void set_start_of_stack(void *start_addr) {
-  start_of_stack = start_addr;
+// Growable array in memory of the collector's own, so a collection never
+// calls back into the heap it has locked
+typedef struct {
+  void *items;
+  size_t count;
+  size_t cap;
+} Vec;
+
+// A heap segment with its side tables: a bit per granule for the start of
+// each live block, and a mark bit per granule set when the block is reached.
+// Nursery chunks keep their tables up to date as they allocate; objects there
+// have a one-word header and no footer.
+typedef struct {
+  char *first;
+  char *end;
+  bool mapped;
+  bool nursery;
+  size_t header;
+  size_t trailer;
+  size_t words;
+  uint64_t *starts;
+  uint64_t *marks;
+} Segment;
+
+typedef struct {
+  // Private mark stack, used without locking
+  Vec stack;
+  // Entries this thread has offered to others, and their count for peeking
+  // without the lock
+  pthread_mutex_t lock;
+  Vec shared;
+  size_t shared_count;
+  // Payloads of the unreachable blocks this thread swept, and the nursery
+  // objects it found dead
+  Vec garbage;
+  size_t nursery_freed;
+} __attribute__((aligned(64))) Worker;
+
+static Worker workers[MAX_GC_THREADS];
+static bool workers_ready = false;
+
+// The collection in progress
+static Segment *segments = NULL;
+static size_t num_segments = 0;
+static char *heap_low = NULL;
+static char *heap_high = NULL;
+// Index of the first sweep task of each segment, with the total at the end
+static size_t *sweep_base = NULL;
+// Ranges the first worker scans before marking starts
+static Vec roots;
+static int active_threads = 1;
+// Shared counters handing out segments and sweep tasks
+static size_t next_segment = 0;
+static size_t next_sweep = 0;
+// Threads that found no work; marking ends when all of them have
+static int idle_threads = 0;
+// Barrier state. The epoch only ever grows, so a thread still leaving one
+// barrier never mistakes the next for it.
+static int barrier_arrived = 0;
+static unsigned barrier_epoch = 0;
+// Set when the collector runs out of memory for its own tables; nothing is
+// freed by that collection
+static bool gc_failed = false;
+
+// Helper threads, woken for every collection
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static unsigned long generation = 0;
+static int pool_threads = 0;
+// Threads per collection, MYMALLOC_GC_THREADS or my_gc_set_threads
+static int gc_threads = 0;
+
+// Nursery chunk states
+enum { CHUNK_FREE, CHUNK_YOUNG, CHUNK_OLD };
+
+static char *nursery = NULL;
+static size_t nursery_chunks = 0;
+static unsigned char *chunk_state = NULL;
+// Side tables of every chunk back to back, CHUNK_WORDS each
+static uint64_t *nursery_starts = NULL;
+static uint64_t *nursery_marks = NULL;
+static pthread_mutex_t nursery_lock = PTHREAD_MUTEX_INITIALIZER;
+// Bumped by every collection, which takes away each thread's current chunk
+static unsigned long nursery_epoch = 1;
+static __thread char *bump_cursor = NULL;
+static __thread char *bump_limit = NULL;
+static __thread unsigned long bump_epoch = 0;
+
+// Card tables, and the cards dirtied since the last collection
+unsigned char *my_card_tables[MY_CARD_TABLES];
+static pthread_mutex_t card_lock = PTHREAD_MUTEX_INITIALIZER;
+static Vec dirty_cards;
+// Set when a card could not be recorded; the next collection is a full one
+static bool cards_lost = false;
+
+// Registered root ranges (Work) and slots (void **). A collection holds the
+// lock throughout, so the marking threads read them unlocked.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Vec root_ranges;
+static Vec root_slots;
+// Payloads of atomic heap blocks sorted by address, guarded by the heap lock
+// so that the free hook can drop them
+static Vec noscan_blocks;
+static pthread_once_t noscan_once = PTHREAD_ONCE_INIT;
+static bool scan_stack = true;
+
+// Size of a block, read straight from its header
+static inline size_t size_of(Block *block) {
+  return block->size & SIZE_MASK;
+}
+
+static void *gc_map(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Make room for `need` items of `size` bytes
+static bool vec_reserve(Vec *vec, size_t size, size_t need) {
+  if (need <= vec->cap) return true;
+  size_t cap = vec->cap == 0 ? 4096 / size : vec->cap;
+  while (cap < need) cap *= 2;
+  void *items = gc_map(cap * size);
+  if (items == NULL) {
+    __atomic_store_n(&gc_failed, true, __ATOMIC_RELAXED);
+    return false;
+  }
+  if (vec->items != NULL) {
+    memcpy(items, vec->items, vec->count * size);
+    munmap(vec->items, vec->cap * size);
+  }
+  vec->items = items;
+  vec->cap = cap;
+  return true;
 }
 
-void *my_malloc(size_t size) {
+static void gc_barrier() {
+  unsigned epoch = __atomic_load_n(&barrier_epoch, __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&barrier_arrived, 1, __ATOMIC_ACQ_REL) == active_threads) {
+    __atomic_store_n(&barrier_arrived, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&barrier_epoch, epoch + 1, __ATOMIC_RELEASE);
+    return;
+  }
+  while (__atomic_load_n(&barrier_epoch, __ATOMIC_ACQUIRE) == epoch) {
+    sched_yield();
+  }
+}
+
+/* Mark stacks */
+
+static void push(Worker *self, char *from, char *to) {
+  if (!vec_reserve(&self->stack, sizeof(Work), self->stack.count + 1)) return;
+  Work *items = self->stack.items;
+  items[self->stack.count++] = (Work){from, to};
+
+  // Offer the oldest half, which tends to be the most work, to idle threads
+  if (self->stack.count >= SHARE_THRESHOLD &&
+      __atomic_load_n(&self->shared_count, __ATOMIC_RELAXED) == 0) {
+    size_t half = self->stack.count / 2;
+    pthread_mutex_lock(&self->lock);
+    if (vec_reserve(&self->shared, sizeof(Work), self->shared.count + half)) {
+      memcpy((Work *)self->shared.items + self->shared.count, items, half * sizeof(Work));
+      self->shared.count += half;
+      memmove(items, items + half, (self->stack.count - half) * sizeof(Work));
+      self->stack.count -= half;
+      __atomic_store_n(&self->shared_count, self->shared.count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&self->lock);
+  }
+}
+
+// Move up to half (at least one) of `victim`'s shared entries to `self`
+static bool take_shared(Worker *self, Worker *victim) {
+  if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) == 0) return false;
+  bool took = false;
+  pthread_mutex_lock(&victim->lock);
+  size_t n = victim == self ? victim->shared.count : (victim->shared.count + 1) / 2;
+  if (n > 0 && vec_reserve(&self->stack, sizeof(Work), self->stack.count + n)) {
+    victim->shared.count -= n;
+    memcpy((Work *)self->stack.items + self->stack.count,
+           (Work *)victim->shared.items + victim->shared.count, n * sizeof(Work));
+    self->stack.count += n;
+    __atomic_store_n(&victim->shared_count, victim->shared.count, __ATOMIC_RELAXED);
+    took = true;
+  }
+  pthread_mutex_unlock(&victim->lock);
+  return took;
+}
+
+static bool pop(Worker *self, Work *work) {
+  if (self->stack.count == 0 && !take_shared(self, self)) return false;
+  *work = ((Work *)self->stack.items)[--self->stack.count];
+  return true;
+}
+
+static bool steal(Worker *self) {
+  int id = self - workers;
+  for (int i = 1; i < active_threads; i++) {
+    if (take_shared(self, &workers[(id + i) % active_threads])) return true;
+  }
+  return false;
+}
+
+static bool work_available() {
+  for (int i = 0; i < active_threads; i++) {
+    if (__atomic_load_n(&workers[i].shared_count, __ATOMIC_RELAXED) != 0) return true;
+  }
+  return false;
+}
+
+/* Marking */
+
+// Segment holding `p`, or NULL
+static Segment *find_segment(char *p) {
+  size_t low = 0, high = num_segments;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (p < segments[mid].first) {
+      high = mid;
+    } else if (p >= segments[mid].end) {
+      low = mid + 1;
+    } else {
+      return &segments[mid];
+    }
+  }
   return NULL;
 }
 
-void my_free(void *ptr) {
-  return; 
+// Granule index of the last live block starting at or before `p`, or -1.
+// The start bitmap only holds live blocks, so a pointer into free memory
+// finds the live block before it; the caller checks the payload range.
+static ptrdiff_t find_block(Segment *seg, char *p) {
+  size_t granule = seg->mapped ? 0 : (p - seg->first) / GRANULE;
+  size_t word = granule / 64;
+  uint64_t bits = seg->starts[word] & ((2ull << (granule % 64)) - 1);
+  while (bits == 0) {
+    if (word == 0) return -1;
+    bits = seg->starts[--word];
+  }
+  return word * 64 + 63 - __builtin_clzll(bits);
+}
+
+static bool is_marked(Segment *seg, size_t index) {
+  return __atomic_load_n(&seg->marks[index / 64], __ATOMIC_RELAXED) & (1ull << (index % 64));
 }
 
+// Set a mark bit, returning whether this thread set it first
+static bool mark(Segment *seg, size_t index) {
+  uint64_t bit = 1ull << (index % 64);
+  return !(__atomic_fetch_or(&seg->marks[index / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// Position of the first atomic heap block at or after `payload`
+static size_t noscan_position(char *payload) {
+  size_t low = 0, high = noscan_blocks.count;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (((char **)noscan_blocks.items)[mid] < payload) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static bool is_noscan(Segment *seg, Block *block, char *payload) {
+  if (seg->nursery) return block->size & NOSCAN_FLAG;
+  if (noscan_blocks.count == 0) return false;
+  size_t i = noscan_position(payload);
+  return i < noscan_blocks.count && ((char **)noscan_blocks.items)[i] == payload;
+}
+
+// Stack frames are read whole, including the sanitizer's redzones
+__attribute__((no_sanitize_address))
+static void scan(Worker *self, Work work) {
+  if (work.to - work.from > SCAN_CHUNK) {
+    push(self, work.from + SCAN_CHUNK, work.to);
+    work.to = work.from + SCAN_CHUNK;
+  }
+  for (char **word = (char **)work.from; (char *)word < work.to; word++) {
+    char *p = *word;
+    if (p < heap_low || p >= heap_high) continue;
+    Segment *seg = find_segment(p);
+    if (seg == NULL) continue;
+    ptrdiff_t index = find_block(seg, p);
+    // A marked block needs nothing more, whether or not `p` is inside it, so
+    // only the first visit reads the header for the range check
+    if (index < 0 || is_marked(seg, index)) continue;
+    Block *block = (Block *)(seg->first + index * GRANULE);
+    char *payload = (char *)block + seg->header;
+    char *end = (char *)block + size_of(block) - seg->trailer;
+    if (p < payload || p >= end || !mark(seg, index)) continue;
+    // Atomic objects are kept alive but never looked into
+    if (is_noscan(seg, block, payload)) continue;
+    push(self, payload, end);
+  }
+}
+
+static void mark_loop(Worker *self) {
+  Work work;
+  for (;;) {
+    while (pop(self, &work)) {
+      scan(self, work);
+    }
+    if (steal(self)) continue;
+
+    __atomic_add_fetch(&idle_threads, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+      if (__atomic_load_n(&idle_threads, __ATOMIC_ACQUIRE) == active_threads) return;
+      if (work_available()) {
+        __atomic_sub_fetch(&idle_threads, 1, __ATOMIC_ACQ_REL);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+/* Phases */
+
+// Record the start of every live block in a segment
+static void find_starts(Segment *seg) {
+  if (seg->nursery) return;
+  if (seg->mapped) {
+    seg->starts[0] = my_block_is_live((Block *)seg->first);
+    return;
+  }
+  for (char *p = seg->first; p < seg->end; p += size_of((Block *)p)) {
+    if (my_block_is_live((Block *)p)) {
+      size_t index = (p - seg->first) / GRANULE;
+      seg->starts[index / 64] |= 1ull << (index % 64);
+    }
+  }
+}
+
+// Collect the live, unmarked blocks of one sweep task
+static void sweep(Worker *self, size_t task) {
+  size_t i = 0;
+  while (sweep_base[i + 1] <= task) i++;
+  Segment *seg = &segments[i];
+  size_t from = (task - sweep_base[i]) * SWEEP_WORDS;
+  size_t to = from + SWEEP_WORDS < seg->words ? from + SWEEP_WORDS : seg->words;
+  if (seg->nursery) {
+    // Dead nursery objects are dropped from the start bits; their chunk is
+    // reset once none are left
+    for (size_t word = from; word < to; word++) {
+      self->nursery_freed += __builtin_popcountll(seg->starts[word] & ~seg->marks[word]);
+      seg->starts[word] &= seg->marks[word];
+    }
+    return;
+  }
+  for (size_t word = from; word < to; word++) {
+    uint64_t dead = seg->starts[word] & ~seg->marks[word];
+    while (dead != 0) {
+      size_t index = word * 64 + __builtin_ctzll(dead);
+      dead &= dead - 1;
+      if (!vec_reserve(&self->garbage, sizeof(void *), self->garbage.count + 1)) return;
+      ((void **)self->garbage.items)[self->garbage.count++] =
+          seg->first + index * GRANULE + kMetadataSize;
+    }
+  }
+}
+
+// One thread's share of a collection
+static void gc_work(Worker *self) {
+  size_t i;
+  while ((i = __atomic_fetch_add(&next_segment, 1, __ATOMIC_RELAXED)) < num_segments) {
+    find_starts(&segments[i]);
+  }
+  gc_barrier();
+
+  if (self == workers) {
+    for (size_t r = 0; r < roots.count; r++) {
+      Work *root = (Work *)roots.items + r;
+      push(self, root->from, root->to);
+    }
+  }
+  mark_loop(self);
+  gc_barrier();
+
+  if (__atomic_load_n(&gc_failed, __ATOMIC_RELAXED)) return;
+  while ((i = __atomic_fetch_add(&next_sweep, 1, __ATOMIC_RELAXED)) < sweep_base[num_segments]) {
+    sweep(self, i);
+  }
+  gc_barrier();
+}
+
+static void *gc_thread_main(void *arg) {
+  Worker *self = arg;
+  unsigned long seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool_lock);
+    while (generation == seen) {
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    seen = generation;
+    bool active = self - workers < active_threads;
+    pthread_mutex_unlock(&pool_lock);
+    if (active) gc_work(self);
+  }
+  return NULL;
+}
+
+/* Setup */
+
+static void init_workers() {
+  if (workers_ready) return;
+  for (int i = 0; i < MAX_GC_THREADS; i++) {
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+  if (gc_threads == 0) {
+    const char *env = getenv("MYMALLOC_GC_THREADS");
+    gc_threads = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  my_gc_set_threads(gc_threads);
+  workers_ready = true;
+}
+
+// Start helpers until `n` threads can take part, returning how many can
+static int start_helpers(int n) {
+  while (pool_threads + 1 < n) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, gc_thread_main, &workers[pool_threads + 1]) != 0) break;
+    pthread_detach(thread);
+    pool_threads++;
+  }
+  return pool_threads + 1 < n ? pool_threads + 1 : n;
+}
+
+static int compare_segments(const void *a, const void *b) {
+  const Segment *x = a, *y = b;
+  return (x->first > y->first) - (x->first < y->first);
+}
+
+static int compare_ranges(const void *a, const void *b) {
+  const MyHeapSegment *x = a, *y = b;
+  return (x->first > y->first) - (x->first < y->first);
+}
+
+static bool collected(size_t chunk, bool full) {
+  return chunk_state[chunk] == CHUNK_YOUNG || (full && chunk_state[chunk] == CHUNK_OLD);
+}
+
+// Point a segment at a nursery chunk's own side tables, with no marks yet
+static void chunk_segment(Segment *seg, size_t chunk) {
+  seg->first = nursery + chunk * NURSERY_CHUNK;
+  seg->end = seg->first + NURSERY_CHUNK;
+  seg->mapped = false;
+  seg->nursery = true;
+  seg->header = GRANULE;
+  seg->trailer = 0;
+  seg->words = CHUNK_WORDS;
+  seg->starts = nursery_starts + chunk * CHUNK_WORDS;
+  seg->marks = nursery_marks + chunk * CHUNK_WORDS;
+  memset(seg->marks, 0, CHUNK_WORDS * sizeof(uint64_t));
+}
+
+// Snapshot the segments a collection covers and map their side tables, with
+// the heap lock held: the whole heap and nursery for a full collection, the
+// young chunks for a minor one. False if the collector is out of memory.
+static bool setup_segments(bool full) {
+  size_t n_heap = full ? my_heap_segments(NULL, 0) : 0;
+  size_t n = n_heap;
+  for (size_t c = 0; c < nursery_chunks; c++) {
+    n += collected(c, full);
+  }
+  MyHeapSegment *heap = gc_map(n_heap * sizeof(MyHeapSegment) + 1);
+  segments = gc_map(n * sizeof(Segment) + 1);
+  sweep_base = gc_map((n + 1) * sizeof(size_t));
+  if (heap == NULL || segments == NULL || sweep_base == NULL) {
+    if (heap != NULL) munmap(heap, n_heap * sizeof(MyHeapSegment) + 1);
+    return false;
+  }
+  my_heap_segments(heap, n_heap);
+
+  num_segments = n;
+  bool ok = true;
+  for (size_t i = 0; i < n_heap; i++) {
+    Segment *seg = &segments[i];
+    seg->first = (char *)heap[i].first;
+    seg->end = heap[i].end;
+    seg->mapped = heap[i].mapped;
+    seg->nursery = false;
+    seg->header = kMetadataSize;
+    seg->trailer = sizeof(size_t);
+    seg->words = seg->mapped ? 1 : ((seg->end - seg->first) / GRANULE + 63) / 64;
+    if (seg->words == 0) seg->words = 1;
+    seg->starts = gc_map(seg->words * sizeof(uint64_t));
+    seg->marks = gc_map(seg->words * sizeof(uint64_t));
+    ok &= seg->starts != NULL && seg->marks != NULL;
+  }
+  munmap(heap, n_heap * sizeof(MyHeapSegment) + 1);
+  size_t i = n_heap;
+  for (size_t c = 0; c < nursery_chunks; c++) {
+    if (collected(c, full)) chunk_segment(&segments[i++], c);
+  }
+
+  qsort(segments, n, sizeof(Segment), compare_segments);
+  heap_low = n > 0 ? segments[0].first : NULL;
+  heap_high = heap_low;
+  for (size_t i = 0; i < n; i++) {
+    sweep_base[i + 1] = sweep_base[i] + (segments[i].words + SWEEP_WORDS - 1) / SWEEP_WORDS;
+    if (segments[i].end > heap_high) heap_high = segments[i].end;
+  }
+  return ok;
+}
+
+static void release_segments() {
+  for (size_t i = 0; i < num_segments; i++) {
+    if (segments[i].nursery) continue;
+    if (segments[i].starts != NULL) munmap(segments[i].starts, segments[i].words * sizeof(uint64_t));
+    if (segments[i].marks != NULL) munmap(segments[i].marks, segments[i].words * sizeof(uint64_t));
+  }
+  if (segments != NULL) munmap(segments, num_segments * sizeof(Segment) + 1);
+  if (sweep_base != NULL) munmap(sweep_base, (num_segments + 1) * sizeof(size_t));
+  segments = NULL;
+  sweep_base = NULL;
+  num_segments = 0;
+}
+
+static bool add_root(char *from, char *to) {
+  if (!vec_reserve(&roots, sizeof(Work), roots.count + 1)) return false;
+  ((Work *)roots.items)[roots.count++] = (Work){from, to};
+  return true;
+}
+
+// Add the dirty cards that lie in old memory, the heap and the old chunks, to
+// the roots. A card may also cover headers or free memory, which only makes
+// the scan a little more conservative; cards in memory that has since been
+// unmapped are skipped.
+static bool add_card_roots() {
+  size_t n_heap = my_heap_segments(NULL, 0);
+  size_t n = n_heap + nursery_chunks;
+  MyHeapSegment *ranges = gc_map(n * sizeof(MyHeapSegment) + 1);
+  if (ranges == NULL) return false;
+  my_heap_segments(ranges, n_heap);
+  for (size_t i = 0; i < n_heap; i++) {
+    // A guarded mapping's footer slot is already the guard page
+    if (ranges[i].mapped) ranges[i].end -= sizeof(size_t);
+  }
+  size_t count = n_heap;
+  for (size_t c = 0; c < nursery_chunks; c++) {
+    if (chunk_state[c] != CHUNK_OLD) continue;
+    ranges[count].first = (Block *)(nursery + c * NURSERY_CHUNK);
+    ranges[count].end = nursery + (c + 1) * NURSERY_CHUNK;
+    count++;
+  }
+  qsort(ranges, count, sizeof(MyHeapSegment), compare_ranges);
+
+  bool ok = true;
+  for (size_t d = 0; d < dirty_cards.count && ok; d++) {
+    char *from = ((char **)dirty_cards.items)[d];
+    char *to = from + (1 << MY_CARD_SHIFT);
+    // First range ending past the card, then every range it overlaps
+    size_t low = 0, high = count;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (ranges[mid].end <= from) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    for (size_t r = low; r < count && (char *)ranges[r].first < to; r++) {
+      char *start = (char *)ranges[r].first > from ? (char *)ranges[r].first : from;
+      ok &= add_root(start, ranges[r].end < to ? ranges[r].end : to);
+    }
+  }
+  munmap(ranges, n * sizeof(MyHeapSegment) + 1);
+  return ok;
+}
+
+// Add every thread's cache to the roots. Cached blocks look allocated to the
+// heap, and other threads keep their caches while this one collects.
+static bool add_cache_roots() {
+  size_t n = my_thread_caches(NULL, 0);
+  MyThreadCache **caches = gc_map(n * sizeof(MyThreadCache *) + 1);
+  if (caches == NULL) return false;
+  my_thread_caches(caches, n);
+  bool ok = true;
+  for (size_t i = 0; i < n; i++) {
+    ok &= add_root((char *)caches[i], (char *)(caches[i] + 1));
+  }
+  munmap(caches, n * sizeof(MyThreadCache *) + 1);
+  return ok;
+}
+
+// Add the registered ranges and slots to the roots
+static bool add_registered_roots() {
+  bool ok = true;
+  for (size_t r = 0; r < root_ranges.count; r++) {
+    Work *range = (Work *)root_ranges.items + r;
+    if (range->from < range->to) ok &= add_root(range->from, range->to);
+  }
+  for (size_t r = 0; r < root_slots.count; r++) {
+    void **slot = ((void ***)root_slots.items)[r];
+    ok &= add_root((char *)slot, (char *)(slot + 1));
+  }
+  return ok;
+}
+
+// Forget the atomic heap blocks this full collection did not mark, which
+// are being freed, all at once rather than one by one through the hook
+static void prune_noscan() {
+  char **items = noscan_blocks.items;
+  size_t kept = 0;
+  for (size_t i = 0; i < noscan_blocks.count; i++) {
+    char *block = items[i] - kMetadataSize;
+    Segment *seg = find_segment(block);
+    if (seg != NULL && is_marked(seg, seg->mapped ? 0 : (block - seg->first) / GRANULE)) {
+      items[kept++] = items[i];
+    }
+  }
+  noscan_blocks.count = kept;
+}
+
+// Clean every dirty card, with the heap lock held
+static void clear_cards() {
+  pthread_mutex_lock(&card_lock);
+  for (size_t d = 0; d < dirty_cards.count; d++) {
+    uintptr_t addr = (uintptr_t)((char **)dirty_cards.items)[d];
+    unsigned char *cards = my_card_tables[addr >> MY_CARD_TABLE_SHIFT];
+    cards[(addr & ((1ul << MY_CARD_TABLE_SHIFT) - 1)) >> MY_CARD_SHIFT] = 0;
+  }
+  dirty_cards.count = 0;
+  cards_lost = false;
+  pthread_mutex_unlock(&card_lock);
+}
+
+// Top of the calling thread's stack: the address given to set_start_of_stack,
+// or else the end of the thread's stack mapping
+static char *stack_top() {
+  if (start_of_stack != NULL) return start_of_stack;
+#ifdef __linux__
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    return (char *)addr + size;
+  }
+#endif
+  return NULL;
+}
+
+/* API */
+
+// Call this function in your test code (at the start of main)
+void set_start_of_stack(void *start_addr) {
+  start_of_stack = start_addr;
+}
+
+// Frame of the caller. Only meaningful when frame pointers are kept, which
+// is why my_gc finds the bottom of its own stack another way.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wframe-address"
 void *get_end_of_stack() {
   return __builtin_frame_address(1);
 }
+#pragma GCC diagnostic pop
+
+// Threads used by later collections, capped at MAX_GC_THREADS; 1 collects on
+// the calling thread alone
+void my_gc_set_threads(int n) {
+  pthread_mutex_lock(&pool_lock);
+  gc_threads = n < 1 ? 1 : n > MAX_GC_THREADS ? MAX_GC_THREADS : n;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// Run a collection, of the whole heap or of the young chunks alone, with the
+// stack from `bottom` up as a root, and return how many blocks and nursery
+// objects it freed
+__attribute__((noinline)) static size_t collect_from(bool full, char *bottom) {
+  char *top = stack_top();
+
+  my_heap_lock();
+  pthread_mutex_lock(&nursery_lock);
+  pthread_mutex_lock(&registry_lock);
+  init_workers();
+  // Without a complete remembered set a minor collection could miss pointers
+  full |= __atomic_load_n(&cards_lost, __ATOMIC_RELAXED);
+  gc_failed = false;
+  roots.count = 0;
+  bool ok = setup_segments(full);
+  if (scan_stack) {
+    ok &= top != NULL && add_root(bottom, top);
+  }
+  ok &= add_cache_roots();
+  ok &= add_registered_roots();
+  if (!full) ok &= add_card_roots();
+  if (!ok) {
+    release_segments();
+    pthread_mutex_unlock(&registry_lock);
+    pthread_mutex_unlock(&nursery_lock);
+    my_heap_unlock();
+    return 0;
+  }
+
+  next_segment = 0;
+  next_sweep = 0;
+  idle_threads = 0;
+  for (int i = 0; i < MAX_GC_THREADS; i++) {
+    workers[i].stack.count = 0;
+    workers[i].shared.count = 0;
+    workers[i].shared_count = 0;
+    workers[i].garbage.count = 0;
+    workers[i].nursery_freed = 0;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  active_threads = start_helpers(gc_threads);
+  if (active_threads > 1) {
+    generation++;
+    pthread_cond_broadcast(&pool_wake);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  gc_work(&workers[0]);
+
+  // Out of memory while marking leaves reachable blocks unmarked, in which
+  // case the sweep was skipped and everything is kept
+  size_t freed = 0;
+  bool failed = __atomic_load_n(&gc_failed, __ATOMIC_RELAXED);
+  if (!failed) {
+    // Chunks with survivors are old from now on, the rest start over
+    for (size_t c = 0; c < nursery_chunks; c++) {
+      if (!collected(c, full)) continue;
+      uint64_t any = 0;
+      for (size_t w = 0; w < CHUNK_WORDS; w++) {
+        any |= nursery_starts[c * CHUNK_WORDS + w];
+      }
+      chunk_state[c] = any ? CHUNK_OLD : CHUNK_FREE;
+    }
+    // No young objects are left, so no old one can point at one
+    clear_cards();
+    if (full) prune_noscan();
+    for (int i = 0; i < active_threads; i++) {
+      freed += workers[i].nursery_freed;
+    }
+  }
+  __atomic_store_n(&nursery_epoch, nursery_epoch + 1, __ATOMIC_RELAXED);
+  release_segments();
+  pthread_mutex_unlock(&registry_lock);
+  pthread_mutex_unlock(&nursery_lock);
+  my_heap_unlock();
+
+  if (failed) return 0;
+  for (int i = 0; i < active_threads; i++) {
+    if (workers[i].garbage.count == 0) continue;
+    my_free_batch(workers[i].garbage.items, workers[i].garbage.count);
+    freed += workers[i].garbage.count;
+  }
+  return freed;
+}
+
+// Spill callee-saved registers into this frame and collect from a frame
+// below it. The stack scan starts at the registers, so it covers the callers'
+// frames but none of the collector's own locals.
+__attribute__((noinline)) static size_t collect(bool full) {
+  jmp_buf registers;
+  // setjmp leaves the signal mask unwritten; stale words there would be roots
+  memset(registers, 0, sizeof(registers));
+  setjmp(registers);
+  return collect_from(full, (char *)((uintptr_t)&registers & ~(GRANULE - 1)));
+}
+
+/* Nursery */
+
+// Map the nursery and its side tables, with the nursery lock held
+static bool init_nursery() {
+  if (nursery != NULL) return true;
+  size_t size = NURSERY_SIZE;
+  const char *env = getenv("MYMALLOC_NURSERY_SIZE");
+  if (env != NULL) {
+    char *end;
+    size = strtoull(env, &end, 10);
+    switch (*end) {
+    case 'g': case 'G': size <<= 10; // fall through
+    case 'm': case 'M': size <<= 10; // fall through
+    case 'k': case 'K': size <<= 10;
+    }
+  }
+  size_t chunks = (size + NURSERY_CHUNK - 1) / NURSERY_CHUNK;
+  if (chunks == 0) chunks = 1;
+
+  char *mem = mmap(NULL, chunks * NURSERY_CHUNK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  chunk_state = gc_map(chunks);
+  nursery_starts = gc_map(chunks * CHUNK_WORDS * sizeof(uint64_t));
+  nursery_marks = gc_map(chunks * CHUNK_WORDS * sizeof(uint64_t));
+  if (mem == MAP_FAILED || chunk_state == NULL || nursery_starts == NULL || nursery_marks == NULL) {
+    return false;
+  }
+  nursery_chunks = chunks;
+  nursery = mem;
+  return true;
+}
+
+// Give the calling thread a zeroed young chunk to bump through, running a
+// minor collection first if every chunk is in use. False if there is none.
+static bool next_chunk() {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    pthread_mutex_lock(&nursery_lock);
+    if (!init_nursery()) {
+      pthread_mutex_unlock(&nursery_lock);
+      return false;
+    }
+    for (size_t c = 0; c < nursery_chunks; c++) {
+      if (chunk_state[c] != CHUNK_FREE) continue;
+      chunk_state[c] = CHUNK_YOUNG;
+      bump_epoch = nursery_epoch;
+      pthread_mutex_unlock(&nursery_lock);
+      bump_cursor = nursery + c * NURSERY_CHUNK;
+      bump_limit = bump_cursor + NURSERY_CHUNK;
+      memset(bump_cursor, 0, NURSERY_CHUNK);
+      return true;
+    }
+    pthread_mutex_unlock(&nursery_lock);
+    if (attempt == 0) collect(false);
+  }
+  return false;
+}
+
+// Objects too big for the nursery, or allocated when it is full, go straight
+// to the heap; they are only collected by my_gc
+static void *allocate_old(size_t size) {
+  void *p = my_malloc(size);
+  if (p != NULL) memset(p, 0, size);
+  return p;
+}
+
+// Drop a freed block from the atomic blocks, with the heap lock held, so a
+// block later allocated at the same address is scanned
+static void forget_noscan(void *payload) {
+  if (noscan_blocks.count == 0) return;
+  char **items = noscan_blocks.items;
+  size_t i = noscan_position(payload);
+  if (i == noscan_blocks.count || items[i] != payload) return;
+  memmove(items + i, items + i + 1, (noscan_blocks.count - i - 1) * sizeof(char *));
+  noscan_blocks.count--;
+}
+
+static void set_free_hook() {
+  my_heap_set_free_hook(forget_noscan);
+}
+
+// Atomic objects too big for the nursery, recorded so marking skips them. They
+// are kept out of the inline thread cache, whose frees never reach the hook.
+static void *allocate_noscan(size_t size) {
+  pthread_once(&noscan_once, set_free_hook);
+  char *p = my_malloc(size > MY_TCACHE_MAX_SIZE ? size : MY_TCACHE_MAX_SIZE + 1);
+  if (p == NULL) return NULL;
+  my_heap_lock();
+  bool ok = vec_reserve(&noscan_blocks, sizeof(char *), noscan_blocks.count + 1);
+  if (ok) {
+    char **items = noscan_blocks.items;
+    size_t i = noscan_position(p);
+    memmove(items + i + 1, items + i, (noscan_blocks.count - i) * sizeof(char *));
+    items[i] = p;
+    noscan_blocks.count++;
+  }
+  my_heap_unlock();
+  if (!ok) {
+    my_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+// Bump-allocate an object with `flags` in its header, or NULL if the nursery
+// has no room
+static void *allocate_young(size_t size, size_t flags) {
+  // One header word holding the object's size
+  size_t total = (size + 2 * GRANULE - 1) & ~(GRANULE - 1);
+  if (bump_epoch != __atomic_load_n(&nursery_epoch, __ATOMIC_RELAXED) ||
+      (size_t)(bump_limit - bump_cursor) < total) {
+    if (!next_chunk()) return NULL;
+  }
+  char *object = bump_cursor;
+  bump_cursor += total;
+  *(size_t *)object = total | flags;
+  size_t index = (object - nursery) / GRANULE;
+  nursery_starts[index / 64] |= 1ull << (index % 64);
+  return object + GRANULE;
+}
+
+// Free every block that cannot be reached from the calling thread's roots,
+// returning how many were freed
+size_t my_gc() {
+  return collect(true);
+}
+
+// Collect the nursery alone, tracing from the roots and the dirty cards.
+// Returns how many young objects were freed.
+size_t my_gc_minor() {
+  return collect(false);
+}
+
+// Allocate a zeroed, collected object, from the nursery when it fits
+void *my_gc_alloc(size_t size) {
+  if (size == 0) return NULL;
+  void *p = size <= NURSERY_MAX_OBJECT ? allocate_young(size, 0) : NULL;
+  return p != NULL ? p : allocate_old(size);
+}
+
+// Allocate a collected object that is never scanned for pointers
+void *my_gc_alloc_atomic(size_t size) {
+  if (size == 0) return NULL;
+  void *p = size <= NURSERY_MAX_OBJECT ? allocate_young(size, NOSCAN_FLAG) : NULL;
+  return p != NULL ? p : allocate_noscan(size);
+}
+
+// Scan the words in [low, high) on every collection
+int my_gc_add_roots(void *low, void *high) {
+  // Only whole words inside the range are read
+  char *from = (char *)(((uintptr_t)low + GRANULE - 1) & ~(GRANULE - 1));
+  char *to = (char *)((uintptr_t)high & ~(GRANULE - 1));
+  pthread_mutex_lock(&registry_lock);
+  bool ok = vec_reserve(&root_ranges, sizeof(Work), root_ranges.count + 1);
+  if (ok) ((Work *)root_ranges.items)[root_ranges.count++] = (Work){from, to};
+  pthread_mutex_unlock(&registry_lock);
+  return ok ? 0 : -1;
+}
+
+// Stop scanning every registered range that lies within [low, high)
+void my_gc_remove_roots(void *low, void *high) {
+  pthread_mutex_lock(&registry_lock);
+  Work *items = root_ranges.items;
+  size_t kept = 0;
+  for (size_t r = 0; r < root_ranges.count; r++) {
+    if (items[r].from < (char *)low || items[r].to > (char *)high) items[kept++] = items[r];
+  }
+  root_ranges.count = kept;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+// Treat the pointer held in `slot` as a root
+int my_gc_add_root(void **slot) {
+  pthread_mutex_lock(&registry_lock);
+  bool ok = vec_reserve(&root_slots, sizeof(void **), root_slots.count + 1);
+  if (ok) ((void ***)root_slots.items)[root_slots.count++] = slot;
+  pthread_mutex_unlock(&registry_lock);
+  return ok ? 0 : -1;
+}
+
+void my_gc_remove_root(void **slot) {
+  pthread_mutex_lock(&registry_lock);
+  void ***items = root_slots.items;
+  for (size_t r = 0; r < root_slots.count; r++) {
+    if (items[r] == slot) {
+      items[r] = items[--root_slots.count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+// Whether collections scan the calling thread's stack and registers
+void my_gc_set_stack_scanning(bool enable) {
+  pthread_mutex_lock(&registry_lock);
+  scan_stack = enable;
+  pthread_mutex_unlock(&registry_lock);
+}
 
-void my_gc() {
-  void *end_of_stack = get_end_of_stack();
+// Slow path of my_gc_write_barrier: map the card table if needed and note
+// the card as dirty
+void my_gc_mark_card(void *field) {
+  uintptr_t addr = (uintptr_t)field;
+  uintptr_t table = addr >> MY_CARD_TABLE_SHIFT;
+  if (table >= MY_CARD_TABLES) return;
 
-  // TODO
+  pthread_mutex_lock(&card_lock);
+  unsigned char *cards = my_card_tables[table];
+  if (cards == NULL) {
+    // Only the pages of the table that get written are ever backed
+    cards = gc_map(1ul << (MY_CARD_TABLE_SHIFT - MY_CARD_SHIFT));
+    __atomic_store_n(&my_card_tables[table], cards, __ATOMIC_RELEASE);
+  }
+  size_t card = (addr & ((1ul << MY_CARD_TABLE_SHIFT) - 1)) >> MY_CARD_SHIFT;
+  if (cards == NULL || !vec_reserve(&dirty_cards, sizeof(char *), dirty_cards.count + 1)) {
+    cards_lost = true;
+  } else if (!cards[card]) {
+    cards[card] = 1;
+    ((char **)dirty_cards.items)[dirty_cards.count++] =
+        (char *)(addr & ~((1ul << MY_CARD_SHIFT) - 1));
+  }
+  pthread_mutex_unlock(&card_lock);
 }
@@ -3,9 +3,61 @@
 
 #include "mymalloc.h"
 #include <stddef.h>
+#include <stdint.h>
 
 void set_start_of_stack(void *start_addr);
 void *get_end_of_stack(void);
-void my_gc(void);
+size_t my_gc(void);
+void my_gc_set_threads(int n);
+
+/* Roots besides the stack. A range is scanned conservatively like the stack;
+   a slot is a single word known to hold a pointer or NULL. Both must stay
+   valid until they are removed. Registration returns 0, or -1 if the
+   collector is out of memory. */
+int my_gc_add_roots(void *low, void *high);
+void my_gc_remove_roots(void *low, void *high);
+int my_gc_add_root(void **slot);
+void my_gc_remove_root(void **slot);
+// With stack scanning off, only the registered roots keep objects alive
+void my_gc_set_stack_scanning(bool enable);
+
+// A collected object whose contents are never scanned for pointers, for
+// strings and other raw bytes. Its contents start undefined.
+void *my_gc_alloc_atomic(size_t size);
+
+/* Generational mode. my_gc_alloc hands out zeroed objects from a bump-pointer
+   nursery and my_gc_minor collects the nursery alone. A pointer stored into an
+   object that may already have survived a collection must be followed by
+   my_gc_write_barrier (MY_GC_STORE does both), or a minor collection will not
+   see it. */
+
+// Each card covers 512 bytes; a card table covers 1 GB of address space and
+// is mapped the first time a store lands in it
+#define MY_CARD_SHIFT 9
+#define MY_CARD_TABLE_SHIFT 30
+#define MY_CARD_TABLES (1ul << (47 - MY_CARD_TABLE_SHIFT))
+
+extern unsigned char *my_card_tables[MY_CARD_TABLES];
+
+void *my_gc_alloc(size_t size);
+size_t my_gc_minor(void);
+void my_gc_mark_card(void *field);
+
+// Record a store into `field`. Only the first store to a clean card leaves
+// the inline path.
+static inline void my_gc_write_barrier(void *field) {
+  uintptr_t addr = (uintptr_t)field;
+  uintptr_t table = addr >> MY_CARD_TABLE_SHIFT;
+  unsigned char *cards = table < MY_CARD_TABLES ? my_card_tables[table] : NULL;
+  if (cards == NULL || !cards[(addr & ((1ul << MY_CARD_TABLE_SHIFT) - 1)) >> MY_CARD_SHIFT]) {
+    my_gc_mark_card(field);
+  }
+}
+
+#define MY_GC_STORE(field, value)    \
+  do {                               \
+    (field) = (value);               \
+    my_gc_write_barrier(&(field));   \
+  } while (0)
 
 #endif
@@ -1,10 +1,21 @@
+#define _GNU_SOURCE
 #include "mymalloc.h"
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef ENABLE_HARDENED
+#include <sys/random.h>
+#include <time.h>
+#endif
 
 // Alignment stuff
 const size_t kAlignment = sizeof(size_t);
@@ -15,23 +26,187 @@ const size_t kBlockOverhead = kMetadataSize + kFooterSize;
 const size_t kMaxAllocationSize = (128ull << 20) - kMetadataSize;
 const size_t kMemorySize = (64ull << 20);
 
-// Single free list
-static Block *free_list = NULL;
+// Free blocks smaller than this sit in exact-size bins; larger ones go in a
+// tree ordered by size, then address
+#define TREE_MIN_SIZE 1024
+#define N_BINS (TREE_MIN_SIZE / sizeof(size_t))
+#define BINMAP_WORDS (N_BINS / 64)
+
+// An arena is a reserved region of address space holding part of the heap. It
+// starts with a fencepost and ends with the "top" block: the uncarved
+// wilderness, which is free but never indexed with the free blocks and has no
+// footer.
+//
+// Pages are committed in steps (see commit_step) as the top is carved, so an
+// arena only costs what has actually been used. Each NUMA node gets its own
+// arenas, created the first time a thread running on that node allocates, and
+// more are added once the existing ones are full. Blocks allocated with a
+// placement hint live in arenas of their own kind (see my_malloc_hint), so
+// blocks of different lifetimes never share an arena. Once several threads
+// allocate, each thread's small blocks live in arenas owned by its thread
+// slot, so they never share a cache line with another thread's.
+typedef struct {
+    char *start;
+    // End of the committed (read/write) part of the reservation
+    char *committed;
+    Block *top;
+    // Free-block index. Size-ordered policies keep one list per small block
+    // size, with a bitmap of the non-empty ones, and a treap of the large
+    // blocks; large blocks freed since the last search wait on the unsorted
+    // list. Address-ordered policies keep every free block in `tree`.
+    Block *bins[N_BINS];
+    uint64_t binmap[BINMAP_WORDS];
+    Block *tree;
+    Block *unsorted;
+    // Next fit resumes its search here
+    char *rover;
+    // Pages from here up to `committed` are untouched or already purged
+    char *clean;
+    // Free blocks with dirty whole pages, oldest first, and the dirty bytes
+    // counted for the top
+    Block *dirty_head;
+    Block *dirty_tail;
+    size_t top_dirty;
+    // Small allocations per bin since the last maintenance pass
+    uint32_t requests[N_BINS];
+    int node;
+    int kind;
+    // Thread slot whose small blocks the arena holds, 0 if shared
+    int owner;
+} Arena;
+
+// Arena kinds: unhinted allocations, then one per placement hint
+enum { KIND_DEFAULT, KIND_SHORT_LIVED, KIND_LONG_LIVED, KIND_HOT, N_KINDS };
+
+#define MAX_ARENAS 64
+
+static Arena arenas[MAX_ARENAS];
+static size_t num_arenas = 0;
+// Most recently created arena of each node and kind
+static Arena *node_arenas[MAX_NUMA_NODES][N_KINDS];
+
+// Thread slots. Once a second thread allocates, every thread that allocates
+// is given the slot with the fewest threads, and its small unhinted blocks
+// come from arenas owned by that slot. Slot 0 stands for the shared arenas.
+// MYMALLOC_THREAD_ARENAS=0 keeps every thread on the shared arenas.
+#define MAX_THREAD_SLOTS 16
+static Arena *slot_arenas[MAX_NUMA_NODES][MAX_THREAD_SLOTS + 1];
+static bool thread_arenas = true;
+static int threads_seen = 0;
+static int slot_threads[MAX_THREAD_SLOTS + 1];
+// -1 until the thread first allocates, then its slot
+static __thread int thread_slot = -1;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+// Line size that MY_HINT_CACHELINE blocks are aligned and padded to
+#define CACHE_LINE 64
+// Reservation size of every arena, MYMALLOC_ARENA_SIZE (default kMemorySize)
+static size_t arena_size = 0;
+static const size_t kMinArenaSize = (1ull << 20);
+// First block of the first arena
 static void *heap_start = NULL;
 
+// Serialises every heap operation so threads may call in concurrently
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// NUMA topology. MYMALLOC_FAKE_NUMA=<n> pretends there are n nodes and hands
+// each thread the next node round-robin, so placement can be exercised on a
+// single-node machine.
+static int numa_nodes = 1;
+static bool fake_numa = false;
+static int next_fake_node = 0;
+static __thread int thread_fake_node = -1;
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
 // Track mmaped blocks
 static Block *mmaped_blocks = NULL;
 
-// Flags
-#define ALLOCATED_FLAG 0x1
-#define FENCEPOST_FLAG 0x2
-#define MMAPED_FLAG    0x4
-#define SIZE_MASK      ~(ALLOCATED_FLAG | FENCEPOST_FLAG | MMAPED_FLAG)
+// Told about every freed block, see my_heap_set_free_hook
+static MyFreeHook free_hook = NULL;
+
+#ifdef ENABLE_HARDENED
+// Bytes reserved after the requested payload for the tail canary
+#define CANARY_SIZE sizeof(size_t)
+// Byte pattern written over quarantined payloads
+#define POISON_BYTE 0xDB
+// Quarantine bounds: at most this many blocks / payload bytes are held back
+#define QUARANTINE_SLOTS 256
+#define QUARANTINE_BYTES (1ull << 20)
+
+// Cookie tags, so a quarantined block can be told apart from a live one
+#define COOKIE_LIVE        0x4c495645ull
+#define COOKIE_QUARANTINED 0x51524e54ull
+
+// Per-process key mixed into cookies, canaries and free-list links
+static uintptr_t heap_secret = 0;
+
+// FIFO of freed blocks not yet returned to the free list
+static Block *quarantine[QUARANTINE_SLOTS];
+static size_t quarantine_head = 0;
+static size_t quarantine_count = 0;
+static size_t quarantine_bytes = 0;
+#else
+#define CANARY_SIZE 0
+#endif
+
+#if defined(ENABLE_HARDENED) || defined(ENABLE_DEBUG)
+// my_free_sized verifies the size it is given instead of trusting it
+#define CHECK_SIZED_FREE
+#endif
+
+#ifdef ENABLE_GUARD_PAGES
+// Requests above this go to their own guarded mapping
+static size_t mmap_threshold = (128ull << 10);
+// Freed guarded mappings stay PROT_NONE until this many more have been freed
+#define RETIRED_SLOTS 64
+
+typedef struct {
+    void *mem;
+    size_t size;
+} Mapping;
+
+static Mapping retired[RETIRED_SLOTS];
+static size_t retired_head = 0;
+static size_t retired_count = 0;
+#else
+// Requests that cannot fit in an arena go to their own mapping
+static size_t mmap_threshold = 0;
+#endif
+
+static size_t page_size = 0;
+
+#ifdef ENABLE_HUGEPAGES
+// Arenas are aligned to this so they can be backed by huge pages
+#define HUGE_PAGE_SIZE (2ull << 20)
+// Requests at least this large are carved from the end of a free block, which
+// keeps small objects packed together in the low huge pages of the arena
+#define TAIL_SPLIT_SIZE (64ull << 10)
+// Commit whole huge pages at a time
+#define COMMIT_CHUNK HUGE_PAGE_SIZE
+#else
+// Granularity in which arena pages are made read/write
+#define COMMIT_CHUNK (64ull << 10)
+#endif
 
 // For stats
 static size_t current_memory_usage = 0;
 static size_t peak_memory_usage = 0;
+// Committed and reserved bytes across arenas and mapped blocks
 static size_t heap_size = 0;
+static size_t heap_reserved = 0;
+static size_t node_usage[MAX_NUMA_NODES];
+
+// Background maintenance (MYMALLOC_DECAY_MS). Bytes the maintenance thread
+// could purge (whole pages of large free blocks and of the top that may still
+// be dirty), bytes of those freed since the last pass, and bytes returned to
+// the OS
+static size_t dirty_bytes = 0;
+static size_t freed_bytes = 0;
+static size_t purged_bytes = 0;
 
 // Set block size
 static void set_block_size(Block *block, size_t size) {
@@ -95,6 +270,32 @@ static size_t *get_footer(Block *block) {
     return (size_t *)((char *)block + get_block_size(block) - kFooterSize);
 }
 
+// Free-list and mmap-list links. Hardened builds store them XOR-ed with the
+// heap secret and the slot address so a forged link is unlikely to decode to
+// a usable pointer.
+#ifdef ENABLE_HARDENED
+#define ENCODE_LINK(slot, ptr) \
+    ((Block *)((uintptr_t)(ptr) ^ heap_secret ^ ((uintptr_t)(slot) >> 12)))
+#else
+#define ENCODE_LINK(slot, ptr) (ptr)
+#endif
+
+static Block *get_next(Block *block) {
+    return ENCODE_LINK(&block->next, block->next);
+}
+
+static Block *get_prev(Block *block) {
+    return ENCODE_LINK(&block->prev, block->prev);
+}
+
+static void set_next(Block *block, Block *next) {
+    block->next = ENCODE_LINK(&block->next, next);
+}
+
+static void set_prev(Block *block, Block *prev) {
+    block->prev = ENCODE_LINK(&block->prev, prev);
+}
+
 // Get previous block
 Block *get_prev_block(Block *block) {
     if (block == NULL || block == heap_start) return NULL;
@@ -108,307 +309,2353 @@ Block *get_prev_block(Block *block) {
     return prev_block;
 }
 
-// Add to free list
-void add_to_free_list(Block *block) {
-    block->next = free_list;
-    if (free_list != NULL) {
-        free_list->prev = block;
-    }
-    block->prev = NULL;
-    free_list = block;
+// Parent link of large free blocks still on the unsorted list
+#define UNSORTED ((Block *)1)
+// Large frees good fit looks through before sorting them into the tree
+#define GOOD_FIT_SCAN 16
+
+#ifndef DEFAULT_POLICY
+#define DEFAULT_POLICY "best"
+#endif
+
+// Large free blocks form a treap keyed by (size, address). The child links
+// reuse the block's free-list fields, `next` for the left child and `prev` for
+// the right, and the parent link sits in the first payload word, so the index
+// needs no memory of its own. Priorities are a hash of the address, which
+// keeps the tree balanced in expectation without storing anything.
+static Block *tree_left(Block *block) {
+    return get_next(block);
 }
 
-// Remove from free list
-void remove_from_free_list(Block *block) {
-    if (block->prev != NULL) {
-        block->prev->next = block->next;
+static Block *tree_right(Block *block) {
+    return get_prev(block);
+}
+
+static Block **parent_slot(Block *block) {
+    return (Block **)((char *)block + kMetadataSize);
+}
+
+static Block *tree_parent(Block *block) {
+    Block **slot = parent_slot(block);
+    return ENCODE_LINK(slot, *slot);
+}
+
+static void set_tree_left(Block *block, Block *left) {
+    set_next(block, left);
+}
+
+static void set_tree_right(Block *block, Block *right) {
+    set_prev(block, right);
+}
+
+static void set_tree_parent(Block *block, Block *parent) {
+    Block **slot = parent_slot(block);
+    *slot = ENCODE_LINK(slot, parent);
+}
+
+static uint64_t tree_priority(Block *block) {
+    uint64_t x = (uintptr_t)block;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    return x ^ (x >> 33);
+}
+
+// Order by size, then address
+static bool tree_less(Block *a, size_t a_size, Block *b) {
+    size_t b_size = get_block_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+// Point `parent` (or the root) at `child` where it pointed at `old`
+static void tree_replace_child(Arena *arena, Block *parent, Block *old, Block *child) {
+    if (parent == NULL) {
+        arena->tree = child;
+    } else if (tree_left(parent) == old) {
+        set_tree_left(parent, child);
     } else {
-        free_list = block->next;
+        set_tree_right(parent, child);
     }
-    if (block->next != NULL) {
-        block->next->prev = block->prev;
+    if (child != NULL) {
+        set_tree_parent(child, parent);
     }
-    block->next = NULL;
-    block->prev = NULL;
 }
 
-// Initialize heap
-static void init_heap() {
-    if (heap_start == NULL) {
-        void *mem = mmap(NULL, kMemorySize, PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mem == MAP_FAILED) {
-            LOG("Failed to init heap\n");
-            return;
-        }
+// Rotate `block` above its parent
+static void tree_rotate_up(Arena *arena, Block *block) {
+    Block *parent = tree_parent(block);
+    Block *grandparent = tree_parent(parent);
+    Block *inner;
+    if (tree_left(parent) == block) {
+        inner = tree_right(block);
+        set_tree_left(parent, inner);
+        set_tree_right(block, parent);
+    } else {
+        inner = tree_left(block);
+        set_tree_right(parent, inner);
+        set_tree_left(block, parent);
+    }
+    if (inner != NULL) {
+        set_tree_parent(inner, parent);
+    }
+    set_tree_parent(parent, block);
+    tree_replace_child(arena, grandparent, parent, block);
+}
 
-        heap_start = (char *)mem + kMetadataSize;
-        heap_size += kMemorySize;
-
-        // Start fencepost
-        Block *start_fencepost = (Block *)mem;
-        start_fencepost->size = 0;
-        set_allocated(start_fencepost, true);
-        set_fencepost(start_fencepost, true);
-        set_mmaped(start_fencepost, false);
-
-        // End fencepost
-        Block *end_fencepost = (Block *)((char *)mem + kMemorySize - kMetadataSize);
-        end_fencepost->size = 0;
-        set_allocated(end_fencepost, true);
-        set_fencepost(end_fencepost, true);
-        set_mmaped(end_fencepost, false);
-
-        // Free block
-        Block *initial_block = (Block *)heap_start;
-        size_t initial_block_size = kMemorySize - 2 * kMetadataSize;
-        set_block_size(initial_block, initial_block_size);
-        set_allocated(initial_block, false);
-        set_fencepost(initial_block, false);
-        set_mmaped(initial_block, false);
-        initial_block->next = NULL;
-        initial_block->prev = NULL;
+static void tree_insert(Arena *arena, Block *block) {
+    size_t size = get_block_size(block);
+    Block *parent = NULL;
+    Block *current = arena->tree;
+    bool left = false;
+    while (current != NULL) {
+        parent = current;
+        left = tree_less(block, size, current);
+        current = left ? tree_left(current) : tree_right(current);
+    }
 
-        // Footer
-        size_t *footer = get_footer(initial_block);
-        *footer = initial_block->size;
+    set_tree_left(block, NULL);
+    set_tree_right(block, NULL);
+    set_tree_parent(block, parent);
+    if (parent == NULL) {
+        arena->tree = block;
+    } else if (left) {
+        set_tree_left(parent, block);
+    } else {
+        set_tree_right(parent, block);
+    }
 
-        add_to_free_list(initial_block);
+    uint64_t priority = tree_priority(block);
+    while ((parent = tree_parent(block)) != NULL && priority > tree_priority(parent)) {
+        tree_rotate_up(arena, block);
     }
 }
 
-// Split block
-static void split_block(Block *block, size_t size) {
-    size_t blockSize = get_block_size(block);
-    if (blockSize >= size + kBlockOverhead + kMinAllocationSize) {
-        Block *new_block = (Block *)((char *)block + size);
-        size_t new_block_size = blockSize - size;
-        set_block_size(new_block, new_block_size);
-        set_allocated(new_block, false);
-        set_fencepost(new_block, false);
-        set_mmaped(new_block, is_mmaped(block));
-        new_block->next = NULL;
-        new_block->prev = NULL;
+// Rotate `block` down until it has at most one child, then splice it out
+static void tree_remove(Arena *arena, Block *block) {
+    for (;;) {
+        Block *left = tree_left(block);
+        Block *right = tree_right(block);
+        if (left == NULL || right == NULL) {
+            tree_replace_child(arena, tree_parent(block), block, left != NULL ? left : right);
+            return;
+        }
+        tree_rotate_up(arena, tree_priority(left) > tree_priority(right) ? left : right);
+    }
+}
 
-        // Footer
-        size_t *new_footer = get_footer(new_block);
-        *new_footer = new_block->size;
+// Smallest block of at least `size` bytes, lowest address on ties
+static Block *tree_best_fit(Block *root, size_t size) {
+    Block *best = NULL;
+    while (root != NULL) {
+        if (get_block_size(root) >= size) {
+            best = root;
+            root = tree_left(root);
+        } else {
+            root = tree_right(root);
+        }
+    }
+    return best;
+}
 
-        set_block_size(block, size);
-        size_t *block_footer = get_footer(block);
-        *block_footer = block->size;
+static size_t bin_index(size_t size) {
+    return size / kAlignment;
+}
 
-        add_to_free_list(new_block);
+static void list_push(Block **head, Block *block) {
+    set_next(block, *head);
+    if (*head != NULL) {
+        set_prev(*head, block);
     }
+    set_prev(block, NULL);
+    *head = block;
 }
 
-// Validate pointer
-static int is_valid_pointer(void *p) {
-    if (p == NULL) return 0;
+static void list_unlink(Block **head, Block *block) {
+    Block *next = get_next(block);
+    Block *prev = get_prev(block);
+    if (prev != NULL) {
+        set_next(prev, next);
+    } else {
+        *head = next;
+    }
+    if (next != NULL) {
+        set_prev(next, prev);
+    }
+}
 
-    Block *block = ptr_to_block(p);
-    if (((uintptr_t)block) % kAlignment != 0) return 0;
+// Size index, used by best fit and good fit. Large blocks are parked on the
+// unsorted list and only enter the tree when a search needs them, so blocks
+// that are coalesced again before then never pay for a tree insert.
+static void size_index_insert(Arena *arena, Block *block) {
+    size_t size = get_block_size(block);
+    if (size >= TREE_MIN_SIZE) {
+        list_push(&arena->unsorted, block);
+        set_tree_parent(block, UNSORTED);
+        return;
+    }
 
-    void *heap_end = (char *)heap_start + kMemorySize - kMetadataSize;
-    if ((void *)block >= heap_start && (void *)block < heap_end) return 1;
+    size_t bin = bin_index(size);
+    list_push(&arena->bins[bin], block);
+    arena->binmap[bin / 64] |= 1ull << (bin % 64);
+}
 
-    Block *current = mmaped_blocks;
-    while (current != NULL) {
-        if (block == current) return 1;
-        current = current->next;
+static void size_index_remove(Arena *arena, Block *block) {
+    size_t size = get_block_size(block);
+    if (size < TREE_MIN_SIZE) {
+        size_t bin = bin_index(size);
+        list_unlink(&arena->bins[bin], block);
+        if (arena->bins[bin] == NULL) {
+            arena->binmap[bin / 64] &= ~(1ull << (bin % 64));
+        }
+    } else if (tree_parent(block) == UNSORTED) {
+        list_unlink(&arena->unsorted, block);
+    } else {
+        tree_remove(arena, block);
     }
+}
 
-    return 0;
+// First block of the first non-empty bin at or above `size`. Every bin holds
+// blocks smaller than any large block, so a hit is always the best fit.
+static Block *bin_fit(Arena *arena, size_t size) {
+    if (size >= TREE_MIN_SIZE) return NULL;
+    size_t bin = bin_index(size);
+    for (size_t word = bin / 64; word < BINMAP_WORDS; word++) {
+        uint64_t bits = arena->binmap[word];
+        if (word == bin / 64) bits &= ~0ull << (bin % 64);
+        if (bits != 0) return arena->bins[word * 64 + __builtin_ctzll(bits)];
+    }
+    return NULL;
 }
 
-// Malloc implementation
-void *my_malloc(size_t size) {
-    if (size == 0 || size > kMaxAllocationSize) return NULL;
+static void sort_unsorted(Arena *arena) {
+    while (arena->unsorted != NULL) {
+        Block *block = arena->unsorted;
+        list_unlink(&arena->unsorted, block);
+        tree_insert(arena, block);
+    }
+}
 
-    init_heap();
-    size_t block_size = round_up(size + kBlockOverhead);
-    Block *best_fit = NULL;
+// Smallest block that fits, lowest address on ties
+static Block *best_fit_find(Arena *arena, size_t size) {
+    Block *block = bin_fit(arena, size);
+    if (block != NULL) return block;
+    sort_unsorted(arena);
+    return tree_best_fit(arena->tree, size);
+}
 
-    // Large allocs via mmap
-    if (block_size > kMemorySize - 2 * kMetadataSize) {
-        size_t mmap_size = block_size + 2 * kMetadataSize;
-        void *mem = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mem == MAP_FAILED) {
-            LOG("Failed to mmap\n");
-            return NULL;
-        }
+// Good fit: any block that wastes at most 1/8 of the request. A few recent
+// large frees are tried before they are sorted, and the tree descent stops
+// at the first block close enough. Falls back to the best fit.
+static bool good_enough(size_t block_size, size_t size) {
+    return block_size >= size && block_size - size <= size / 8;
+}
 
-        heap_size += mmap_size;
-
-        // Fenceposts
-        Block *start_fencepost = (Block *)mem;
-        start_fencepost->size = 0;
-        set_allocated(start_fencepost, true);
-        set_fencepost(start_fencepost, true);
-        set_mmaped(start_fencepost, true);
-
-        Block *end_fencepost = (Block *)((char *)mem + mmap_size - kMetadataSize);
-        end_fencepost->size = 0;
-        set_allocated(end_fencepost, true);
-        set_fencepost(end_fencepost, true);
-        set_mmaped(end_fencepost, true);
-
-        // Alloc block
-        Block *new_block = (Block *)((char *)mem + kMetadataSize);
-        set_block_size(new_block, mmap_size - 2 * kMetadataSize);
-        set_allocated(new_block, true);
-        set_fencepost(new_block, false);
-        set_mmaped(new_block, true);
-        size_t *footer = get_footer(new_block);
-        *footer = new_block->size;
-
-        // Track mmaped
-        new_block->next = mmaped_blocks;
-        if (mmaped_blocks != NULL) {
-            mmaped_blocks->prev = new_block;
-        }
-        new_block->prev = NULL;
-        mmaped_blocks = new_block;
-
-        // Update stats
-        size_t payload_size = get_block_size(new_block) - kBlockOverhead;
-        current_memory_usage += payload_size;
-        if (current_memory_usage > peak_memory_usage) {
-            peak_memory_usage = current_memory_usage;
-        }
+static Block *good_fit_find(Arena *arena, size_t size) {
+    Block *block = bin_fit(arena, size);
+    if (block != NULL) return block;
 
-        return (char *)new_block + kMetadataSize;
+    block = arena->unsorted;
+    for (int i = 0; block != NULL && i < GOOD_FIT_SCAN; i++) {
+        if (good_enough(get_block_size(block), size)) return block;
+        block = get_next(block);
     }
+    sort_unsorted(arena);
 
-    // Find best fit
-    int index = 0; // Single free list
-    Block *block = free_list;
+    Block *best = NULL;
+    block = arena->tree;
     while (block != NULL) {
-        size_t bsize = get_block_size(block);
-        if (bsize >= block_size) {
-            if (best_fit == NULL || bsize < get_block_size(best_fit)) {
-                best_fit = block;
-                if (bsize == block_size) break; // Exact fit
-            }
+        size_t block_size = get_block_size(block);
+        if (block_size >= size) {
+            if (good_enough(block_size, size)) return block;
+            best = block;
+            block = tree_left(block);
+        } else {
+            block = tree_right(block);
         }
-        block = block->next;
     }
+    return best;
+}
 
-    if (best_fit != NULL) {
-        remove_from_free_list(best_fit);
-        size_t bsize = get_block_size(best_fit);
-        if (bsize - block_size >= kBlockOverhead + kMinAllocationSize) {
-            split_block(best_fit, block_size);
-        }
+// Address index, used by first fit and next fit: every free block sits in one
+// treap ordered by address. The children reuse `next`/`prev` like the size
+// tree, and the first payload word holds the largest block size in the
+// subtree, which is what lets a search skip subtrees with nothing big enough.
+// Every block has at least one payload word, so small blocks fit too.
+static size_t *span_slot(Block *block) {
+    return (size_t *)((char *)block + kMetadataSize);
+}
 
-        set_allocated(best_fit, true);
-        size_t *footer = get_footer(best_fit);
-        *footer = best_fit->size;
+static size_t span_max(Block *block) {
+    return block != NULL ? *span_slot(block) : 0;
+}
 
-        // Update stats
-        size_t payload_size = get_block_size(best_fit) - kBlockOverhead;
-        current_memory_usage += payload_size;
-        if (current_memory_usage > peak_memory_usage) {
-            peak_memory_usage = current_memory_usage;
-        }
+static void span_update(Block *block) {
+    size_t max = get_block_size(block);
+    size_t left = span_max(tree_left(block));
+    size_t right = span_max(tree_right(block));
+    if (left > max) max = left;
+    if (right > max) max = right;
+    *span_slot(block) = max;
+}
+
+static Block *address_rotate_right(Block *root) {
+    Block *left = tree_left(root);
+    set_tree_left(root, tree_right(left));
+    set_tree_right(left, root);
+    span_update(root);
+    span_update(left);
+    return left;
+}
+
+static Block *address_rotate_left(Block *root) {
+    Block *right = tree_right(root);
+    set_tree_right(root, tree_left(right));
+    set_tree_left(right, root);
+    span_update(root);
+    span_update(right);
+    return right;
+}
 
-        return (char *)best_fit + kMetadataSize;
+// Insert `block` under `root`, returning the new root of the subtree
+static Block *address_insert(Block *root, Block *block) {
+    if (root == NULL) {
+        set_tree_left(block, NULL);
+        set_tree_right(block, NULL);
+        span_update(block);
+        return block;
+    }
+    if (block < root) {
+        Block *left = address_insert(tree_left(root), block);
+        set_tree_left(root, left);
+        if (tree_priority(left) > tree_priority(root)) return address_rotate_right(root);
+    } else {
+        Block *right = address_insert(tree_right(root), block);
+        set_tree_right(root, right);
+        if (tree_priority(right) > tree_priority(root)) return address_rotate_left(root);
     }
+    span_update(root);
+    return root;
+}
 
-    // Couldn't find block
-    return NULL;
+// Join two treaps where every block in `a` is below every block in `b`
+static Block *address_join(Block *a, Block *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (tree_priority(a) > tree_priority(b)) {
+        set_tree_right(a, address_join(tree_right(a), b));
+        span_update(a);
+        return a;
+    }
+    set_tree_left(b, address_join(a, tree_left(b)));
+    span_update(b);
+    return b;
 }
 
-// Free implementation
-void my_free(void *p) {
-    if (p == NULL) return;
-    if (!is_valid_pointer(p)) return;
+// Remove `block`, which must be in the subtree, returning the new root
+static Block *address_remove(Block *root, Block *block) {
+    if (root == block) return address_join(tree_left(root), tree_right(root));
+    if (block < root) {
+        set_tree_left(root, address_remove(tree_left(root), block));
+    } else {
+        set_tree_right(root, address_remove(tree_right(root), block));
+    }
+    span_update(root);
+    return root;
+}
 
-    Block *block = ptr_to_block(p);
-    if (!is_allocated(block)) return;
+static void address_index_insert(Arena *arena, Block *block) {
+    arena->tree = address_insert(arena->tree, block);
+}
 
-    set_allocated(block, false);
-    size_t *footer = get_footer(block);
-    *footer = block->size;
-    size_t payload_size = get_block_size(block) - kBlockOverhead;
-    current_memory_usage -= payload_size;
+static void address_index_remove(Arena *arena, Block *block) {
+    arena->tree = address_remove(arena->tree, block);
+}
 
-    if (is_mmaped(block)) {
-        // Unmap mmaped
-        if (block->prev != NULL) {
-            block->prev->next = block->next;
+// Lowest-addressed block under `root` that fits
+static Block *address_first_fit(Block *root, size_t size) {
+    while (root != NULL && span_max(root) >= size) {
+        Block *left = tree_left(root);
+        if (span_max(left) >= size) {
+            root = left;
+        } else if (get_block_size(root) >= size) {
+            return root;
         } else {
-            mmaped_blocks = block->next;
+            root = tree_right(root);
         }
-        if (block->next != NULL) {
-            block->next->prev = block->prev;
+    }
+    return NULL;
+}
+
+// Lowest-addressed block at or above `from` under `root` that fits
+static Block *address_fit_from(Block *root, char *from, size_t size) {
+    if (root == NULL || span_max(root) < size) return NULL;
+    if ((char *)root < from) return address_fit_from(tree_right(root), from, size);
+
+    Block *block = address_fit_from(tree_left(root), from, size);
+    if (block != NULL) return block;
+    if (get_block_size(root) >= size) return root;
+    return address_first_fit(tree_right(root), size);
+}
+
+static Block *first_fit_find(Arena *arena, size_t size) {
+    return address_first_fit(arena->tree, size);
+}
+
+// Next fit: resume from the last block handed out and wrap around once
+static Block *next_fit_find(Arena *arena, size_t size) {
+    Block *block = address_fit_from(arena->tree, arena->rover, size);
+    if (block == NULL) {
+        block = address_first_fit(arena->tree, size);
+    }
+    if (block != NULL) {
+        arena->rover = (char *)block;
+    }
+    return block;
+}
+
+// Placement policy: how free blocks are indexed and which one an allocation
+// takes. Chosen once, before the first block is freed, from MYMALLOC_POLICY or
+// the POLICY build default.
+typedef struct {
+    const char *name;
+    void (*insert)(Arena *arena, Block *block);
+    void (*remove)(Arena *arena, Block *block);
+    Block *(*find)(Arena *arena, size_t size);
+} Policy;
+
+static const Policy policies[] = {
+    {"best", size_index_insert, size_index_remove, best_fit_find},
+    {"first", address_index_insert, address_index_remove, first_fit_find},
+    {"next", address_index_insert, address_index_remove, next_fit_find},
+    {"good", size_index_insert, size_index_remove, good_fit_find},
+};
+
+static const Policy *policy = &policies[0];
+
+static void init_policy() {
+    const char *name = getenv("MYMALLOC_POLICY");
+    if (name == NULL) name = DEFAULT_POLICY;
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(name, policies[i].name) == 0) {
+            policy = &policies[i];
+            return;
         }
+    }
+    fprintf(stderr, "[malloc] Unknown placement policy %s, using best fit\n", name);
+}
 
-        size_t mmap_size = get_block_size(block) + 2 * kMetadataSize;
-        void *mem = (char *)block - kMetadataSize;
-        munmap(mem, mmap_size);
+/* Dirty pages. Only whole pages inside free blocks of at least
+   PURGE_MIN_BLOCK bytes, and in the top, can be returned to the OS, so only
+   those count as dirty. Each arena keeps its large free blocks with dirty
+   pages on a FIFO, so purging takes the oldest without walking the heap. */
+
+// Smallest block whose interior can hold a whole page; only these are purged
+// and carry a purge mark
+#define PURGE_MIN_BLOCK 4096
+#define PURGE_MAGIC 0x5055524745ull
+#define DIRTY_MAGIC 0x4449525459ull
+
+// Granularity pages are returned to the OS in
+static size_t purge_granule = 0;
+
+// Second payload word of a large free block. It holds a mark tied to the
+// block's address and size: one value once its interior pages have been
+// purged, another while it is on the dirty list. The first word belongs to
+// the free-block index, and the dirty list links follow the mark.
+static size_t *purge_mark(Block *block) {
+    return (size_t *)((char *)block + kMetadataSize) + 1;
+}
+
+static size_t purge_mark_value(Block *block) {
+    return PURGE_MAGIC ^ (uintptr_t)block ^ block->size;
+}
+
+static size_t dirty_mark_value(Block *block) {
+    return DIRTY_MAGIC ^ (uintptr_t)block ^ block->size;
+}
+
+static Block **dirty_next_slot(Block *block) {
+    return (Block **)(purge_mark(block) + 1);
+}
+
+static Block **dirty_prev_slot(Block *block) {
+    return (Block **)(purge_mark(block) + 2);
+}
+
+static Block *dirty_link(Block **slot) {
+    return ENCODE_LINK(slot, *slot);
+}
+
+static void set_dirty_link(Block **slot, Block *link) {
+    *slot = ENCODE_LINK(slot, link);
+}
+
+static char *granule_up(char *p) {
+    return (char *)(((uintptr_t)p + purge_granule - 1) & ~(purge_granule - 1));
+}
+
+static char *granule_down(char *p) {
+    return (char *)((uintptr_t)p & ~(purge_granule - 1));
+}
+
+// Pages are returned in whole huge pages when arenas are backed by them
+static void init_purge_granule() {
+#ifdef ENABLE_HUGEPAGES
+    purge_granule = HUGE_PAGE_SIZE;
+#else
+    purge_granule = sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Whole granules in [from, to)
+static size_t granule_bytes(char *from, char *to) {
+    from = granule_up(from);
+    to = granule_down(to);
+    return to > from ? to - from : 0;
+}
+
+// Part of a large free block that may be purged: past its index word, mark
+// and dirty links, up to its footer
+static char *purgeable_start(Block *block) {
+    return (char *)(dirty_prev_slot(block) + 1);
+}
+
+static char *purgeable_end(Block *block) {
+    return (char *)block + get_block_size(block) - kFooterSize;
+}
+
+// Put a newly listed free block on the dirty list if it has whole pages that
+// have not been purged
+static void dirty_insert(Arena *arena, Block *block) {
+    if (get_block_size(block) < PURGE_MIN_BLOCK || *purge_mark(block) == purge_mark_value(block)) return;
+    size_t bytes = granule_bytes(purgeable_start(block), purgeable_end(block));
+    if (bytes == 0) {
+        *purge_mark(block) = 0;
+        return;
+    }
+
+    *purge_mark(block) = dirty_mark_value(block);
+    set_dirty_link(dirty_next_slot(block), NULL);
+    set_dirty_link(dirty_prev_slot(block), arena->dirty_tail);
+    if (arena->dirty_tail != NULL) {
+        set_dirty_link(dirty_next_slot(arena->dirty_tail), block);
     } else {
-        // Coalesce
-        Block *next = get_next_block(block);
-        if (next && !is_allocated(next) && !is_fencepost(next)) {
-            remove_from_free_list(next);
-            size_t new_size = get_block_size(block) + get_block_size(next);
-            set_block_size(block, new_size);
-            footer = get_footer(block);
-            *footer = block->size;
-        }
+        arena->dirty_head = block;
+    }
+    arena->dirty_tail = block;
+    dirty_bytes += bytes;
+}
 
-        Block *prev = get_prev_block(block);
-        if (prev && !is_allocated(prev) && !is_fencepost(prev)) {
-            remove_from_free_list(prev);
-            size_t new_size = get_block_size(prev) + get_block_size(block);
-            set_block_size(prev, new_size);
-            footer = get_footer(prev);
-            *footer = prev->size;
-            block = prev;
-        }
+// Take a block off the dirty list, if it is on it
+static void dirty_remove(Arena *arena, Block *block) {
+    if (get_block_size(block) < PURGE_MIN_BLOCK || *purge_mark(block) != dirty_mark_value(block)) return;
 
-        add_to_free_list(block);
+    Block *next = dirty_link(dirty_next_slot(block));
+    Block *prev = dirty_link(dirty_prev_slot(block));
+    if (prev != NULL) {
+        set_dirty_link(dirty_next_slot(prev), next);
+    } else {
+        arena->dirty_head = next;
+    }
+    if (next != NULL) {
+        set_dirty_link(dirty_prev_slot(next), prev);
+    } else {
+        arena->dirty_tail = prev;
     }
+    *purge_mark(block) = 0;
+    dirty_bytes -= granule_bytes(purgeable_start(block), purgeable_end(block));
 }
 
-/* Helper functions */
+// Recount the dirty pages of the top after it or `clean` moved
+static void count_top_dirty(Arena *arena) {
+    char *clean = granule_up(arena->clean);
+    size_t bytes = granule_bytes((char *)arena->top + kMetadataSize,
+                                 clean < arena->committed ? clean : arena->committed);
+    dirty_bytes += bytes - arena->top_dirty;
+    arena->top_dirty = bytes;
+}
 
-// Check if free
-int is_free(Block *block) {
-    return !is_allocated(block);
+// Add to free list
+static void add_to_free_list(Arena *arena, Block *block) {
+    policy->insert(arena, block);
+    dirty_insert(arena, block);
 }
 
-// Get block size
-size_t block_size(Block *block) {
-    return get_block_size(block);
+// Remove from free list
+static void remove_from_free_list(Arena *arena, Block *block) {
+    policy->remove(arena, block);
+    dirty_remove(arena, block);
+    set_next(block, NULL);
+    set_prev(block, NULL);
 }
 
-// Start block
-Block *get_start_block(void) {
-    return (Block *)heap_start;
+// Free block for `size` bytes chosen by the placement policy, left indexed
+static Block *find_free(Arena *arena, size_t size) {
+    return policy->find(arena, size);
 }
 
-// Next block
-Block *get_next_block(Block *block) {
-    if (block == NULL || is_fencepost(block)) return NULL;
-    Block *next_block = (Block *)((char *)block + get_block_size(block));
-    if (is_fencepost(next_block) || get_block_size(next_block) == 0) return NULL;
-    return next_block;
+#if defined(ENABLE_HARDENED) || defined(CHECK_SIZED_FREE)
+// Report heap corruption and stop; continuing would hand out poisoned memory
+static void heap_corruption(const char *what, void *p) {
+    fprintf(stderr, "[malloc] %s: %p\n", what, p);
+    abort();
+}
+#endif
+
+#ifdef ENABLE_HARDENED
+// Seed the heap secret from the OS, falling back to ASLR and clock noise
+static void init_heap_secret() {
+    if (getentropy(&heap_secret, sizeof(heap_secret)) != 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        heap_secret = (uintptr_t)&heap_secret ^ (uintptr_t)ts.tv_nsec ^
+                      ((uintptr_t)ts.tv_sec << 32);
+    }
+    heap_secret |= 1;
 }
 
-// Ptr to block
-Block *ptr_to_block(void *ptr) {
-    if (ptr == NULL) return NULL;
-    return (Block *)((char *)ptr - kMetadataSize);
+// Cookie over the fields an overflow from the previous block would hit first
+static size_t block_cookie(Block *block, size_t tag) {
+    size_t x = block->size ^ block->requested ^ (uintptr_t)block ^ heap_secret ^ tag;
+    x ^= x >> 29;
+    x *= 0xbf58476d1ce4e5b9ull;
+    return x ^ (x >> 32);
 }
 
-// Stats
-size_t get_peak_memory_usage() {
-    return peak_memory_usage;
+// Canary value written just past the requested payload. Its first byte always
+// has the high bit set, so an off-by-one write of a NUL or any ASCII byte is
+// guaranteed to be noticed.
+static size_t block_canary(Block *block) {
+    size_t canary = heap_secret ^ ((uintptr_t)block * 0x9e3779b97f4a7c15ull);
+    ((unsigned char *)&canary)[0] |= 0x80;
+    return canary;
 }
 
-size_t get_heap_size() {
-    return heap_size;
+// Guarded mappings end at a PROT_NONE page, which already catches overruns
+static bool has_canary(Block *block) {
+#ifdef ENABLE_GUARD_PAGES
+    return !is_mmaped(block);
+#else
+    return true;
+#endif
+}
+
+// Stamp a freshly allocated block with its cookie and tail canary
+static void arm_block(Block *block, size_t requested) {
+    block->requested = requested;
+    block->cookie = block_cookie(block, COOKIE_LIVE);
+    if (has_canary(block)) {
+        size_t canary = block_canary(block);
+        memcpy((char *)block + kMetadataSize + requested, &canary, CANARY_SIZE);
+    }
+}
+
+// Verify a block passed to free: live cookie and untouched tail canary
+static void check_block(Block *block) {
+    if (block->cookie == block_cookie(block, COOKIE_QUARANTINED)) {
+        heap_corruption("double free", (char *)block + kMetadataSize);
+    }
+    if (!is_allocated(block) || block->cookie != block_cookie(block, COOKIE_LIVE)) {
+        heap_corruption("invalid pointer or corrupted header", (char *)block + kMetadataSize);
+    }
+    size_t canary = block_canary(block);
+    if (has_canary(block) &&
+        memcmp((char *)block + kMetadataSize + block->requested, &canary, CANARY_SIZE) != 0) {
+        heap_corruption("heap buffer overflow", (char *)block + kMetadataSize);
+    }
+}
+
+// Check a block leaving quarantine has not been written since it was freed
+static void check_poison(Block *block) {
+    unsigned char *payload = (unsigned char *)block + kMetadataSize;
+    for (size_t i = 0; i < block->requested; i++) {
+        if (payload[i] != POISON_BYTE) {
+            heap_corruption("write after free", payload);
+        }
+    }
+}
+
+// Hold a freed block back from reuse. Returns the block that should now go to
+// the free list: the oldest quarantined block once the FIFO is over its bounds,
+// the block itself if it is too large to quarantine, or NULL.
+static Block *quarantine_push(Block *block) {
+    size_t bytes = block->requested;
+    if (bytes > QUARANTINE_BYTES) return block;
+
+    memset((char *)block + kMetadataSize, POISON_BYTE, bytes);
+    block->cookie = block_cookie(block, COOKIE_QUARANTINED);
+
+    Block *evicted = NULL;
+    if (quarantine_count == QUARANTINE_SLOTS ||
+        quarantine_bytes + bytes > QUARANTINE_BYTES) {
+        evicted = quarantine[quarantine_head];
+        quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+        quarantine_count--;
+        quarantine_bytes -= evicted->requested;
+        check_poison(evicted);
+    }
+
+    quarantine[(quarantine_head + quarantine_count) % QUARANTINE_SLOTS] = block;
+    quarantine_count++;
+    quarantine_bytes += bytes;
+    return evicted;
+}
+#endif
+
+// Reserve address space for an arena; nothing is accessible until committed.
+// Huge page builds try explicit huge pages first and fall back to a 2 MB
+// aligned mapping that transparent huge pages can back.
+static void *map_arena(size_t size) {
+#ifdef ENABLE_HUGEPAGES
+#ifdef MAP_HUGETLB
+    // Without MAP_NORESERVE this fails up front, rather than faulting on first
+    // touch, when too few huge pages are reserved
+    void *mem = mmap(NULL, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) return mem;
+    LOG("MAP_HUGETLB unavailable, falling back to transparent huge pages\n");
+#endif
+    size_t padded = size + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, padded, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return MAP_FAILED;
+
+    char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + size < raw + padded) {
+        munmap(aligned + size, raw + padded - (aligned + size));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+#else
+    return mmap(NULL, size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
+}
+
+static void init_page_size() {
+    if (page_size == 0) {
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+}
+
+// Bytes committed at a time. Hinted arenas hold fewer blocks than the
+// default ones, and a whole chunk in each would cost more than it saves in
+// holes, so they grow a page at a time unless they are backed by huge pages.
+static size_t commit_step(Arena *arena) {
+#ifdef ENABLE_HUGEPAGES
+    return COMMIT_CHUNK;
+#else
+    return arena->kind != KIND_DEFAULT ? page_size : COMMIT_CHUNK;
+#endif
+}
+
+// Make sure everything below `end` in the arena is committed
+static bool commit_arena(Arena *arena, char *end) {
+    if (end <= arena->committed) return true;
+
+    char *limit = arena->start + arena_size;
+    size_t step = commit_step(arena);
+    char *new_committed = arena->start + ((end - arena->start + step - 1) & ~(step - 1));
+    if (new_committed > limit) new_committed = limit;
+
+    if (mprotect(arena->committed, new_committed - arena->committed,
+                 PROT_READ | PROT_WRITE) != 0) {
+        LOG("Failed to commit arena memory\n");
+        return false;
+    }
+    heap_size += new_committed - arena->committed;
+    arena->committed = new_committed;
+    return true;
+}
+
+// Parse a byte count with an optional K, M or G suffix
+static size_t parse_size(const char *str) {
+    char *end;
+    size_t n = strtoull(str, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': n <<= 10; // fall through
+    case 'm': case 'M': n <<= 10; // fall through
+    case 'k': case 'K': n <<= 10;
+    }
+    return n;
+}
+
+// Arena reservation size and the matching direct-mmap threshold
+static void init_arena_size() {
+    arena_size = kMemorySize;
+    const char *env = getenv("MYMALLOC_ARENA_SIZE");
+    if (env != NULL) {
+        size_t n = parse_size(env);
+        arena_size = n < kMinArenaSize ? kMinArenaSize : n;
+        arena_size = (arena_size + COMMIT_CHUNK - 1) & ~(COMMIT_CHUNK - 1);
+    }
+#ifndef ENABLE_GUARD_PAGES
+    // Largest block an arena can hold besides its fencepost and top header
+    mmap_threshold = arena_size - 2 * kMetadataSize;
+#endif
+}
+
+// Work out how many NUMA nodes to spread arenas over
+static void init_numa() {
+    const char *fake = getenv("MYMALLOC_FAKE_NUMA");
+    if (fake != NULL) {
+        int n = atoi(fake);
+        if (n > 1) {
+            numa_nodes = n < MAX_NUMA_NODES ? n : MAX_NUMA_NODES;
+            fake_numa = true;
+        }
+        return;
+    }
+#ifdef __linux__
+    // "online" lists node ranges such as "0" or "0-1"; the last number is the
+    // highest node id
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL) return;
+    int n, highest = 0;
+    while (fscanf(f, "%d", &n) == 1) {
+        highest = n;
+        fgetc(f);
+    }
+    fclose(f);
+    numa_nodes = highest + 1 < MAX_NUMA_NODES ? highest + 1 : MAX_NUMA_NODES;
+#endif
+}
+
+// NUMA node of the calling thread
+static int current_node() {
+    if (numa_nodes == 1) return 0;
+    if (fake_numa) {
+        if (thread_fake_node < 0) {
+            thread_fake_node = next_fake_node++ % numa_nodes;
+        }
+        return thread_fake_node;
+    }
+    unsigned int cpu, node;
+    if (getcpu(&cpu, &node) != 0) return 0;
+    return (int)(node % numa_nodes);
+}
+
+// Ask the kernel to place the pages of a mapping on `node`. The policy is
+// "preferred" rather than "bind" so a full node spills instead of OOMing.
+static void bind_to_node(void *mem, size_t size, int node) {
+#ifdef __linux__
+    if (numa_nodes == 1 || fake_numa) return;
+    unsigned long mask = 1ul << node;
+    if (syscall(SYS_mbind, mem, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+        LOG("mbind to node %d failed\n", node);
+    }
+#endif
+}
+
+// Where the newest arena of a node, kind and owner is recorded
+static Arena **newest_arena(int node, int kind, int owner) {
+    return owner != 0 ? &slot_arenas[node][owner] : &node_arenas[node][kind];
+}
+
+// Reserve and format a new arena of `kind` on `node`, owned by thread slot
+// `owner`
+static Arena *create_arena(int node, int kind, int owner) {
+    if (num_arenas == MAX_ARENAS) return NULL;
+
+    void *mem = map_arena(arena_size);
+    if (mem == MAP_FAILED) {
+        LOG("Failed to map arena\n");
+        return NULL;
+    }
+    bind_to_node(mem, arena_size, node);
+
+    Arena *arena = &arenas[num_arenas];
+    arena->start = mem;
+    arena->committed = mem;
+    memset(arena->bins, 0, sizeof(arena->bins));
+    memset(arena->binmap, 0, sizeof(arena->binmap));
+    arena->tree = NULL;
+    arena->unsorted = NULL;
+    arena->rover = mem;
+    arena->node = node;
+    arena->kind = kind;
+    arena->owner = owner;
+    if (!commit_arena(arena, (char *)mem + 2 * kMetadataSize)) {
+        munmap(mem, arena_size);
+        return NULL;
+    }
+    heap_reserved += arena_size;
+    num_arenas++;
+    *newest_arena(node, kind, owner) = arena;
+
+    // Start fencepost
+    Block *start_fencepost = (Block *)mem;
+    start_fencepost->size = 0;
+    set_allocated(start_fencepost, true);
+    set_fencepost(start_fencepost, true);
+    set_mmaped(start_fencepost, false);
+
+    // The rest of the reservation is the top block
+    Block *top = (Block *)((char *)mem + kMetadataSize);
+    top->size = 0;
+    set_block_size(top, arena_size - kMetadataSize);
+    arena->top = top;
+    arena->clean = (char *)top + kMetadataSize;
+    arena->dirty_head = NULL;
+    arena->dirty_tail = NULL;
+    arena->top_dirty = 0;
+    memset(arena->requests, 0, sizeof(arena->requests));
+
+    if (heap_start == NULL) {
+        heap_start = top;
+    }
+    return arena;
+}
+
+// Carve a block off the front of the arena's top, committing pages as needed.
+// The top always keeps room for its own header.
+static Block *carve_from_top(Arena *arena, size_t size) {
+    Block *block = arena->top;
+    size_t top_size = get_block_size(block);
+    if (top_size < size + kMetadataSize) return NULL;
+
+    Block *new_top = (Block *)((char *)block + size);
+    if (!commit_arena(arena, (char *)new_top + kMetadataSize)) return NULL;
+    new_top->size = 0;
+    set_block_size(new_top, top_size - size);
+    arena->top = new_top;
+    if ((char *)new_top + kMetadataSize > arena->clean) {
+        arena->clean = (char *)new_top + kMetadataSize;
+    }
+    count_top_dirty(arena);
+
+    set_block_size(block, size);
+    return block;
+}
+
+// Starts the background maintenance thread, defined with the allocation path
+static void init_maintenance();
+// Reads the memory limits from the environment
+static void init_limits();
+// Checks an allocation against the memory limits, defined with them
+static bool within_limits(size_t payload);
+// Gives a heap block back to its arena, defined with the free path
+static void release_block(Arena *arena, Block *block);
+
+static void init_thread_arenas() {
+    const char *env = getenv("MYMALLOC_THREAD_ARENAS");
+    thread_arenas = env == NULL || strcmp(env, "0") != 0;
+}
+
+// Initialize heap
+static void init_heap() {
+    if (heap_start == NULL) {
+#ifdef ENABLE_HARDENED
+        init_heap_secret();
+#endif
+        init_numa();
+        init_arena_size();
+        init_policy();
+        init_limits();
+        init_thread_arenas();
+        init_purge_granule();
+        init_page_size();
+        create_arena(current_node(), KIND_DEFAULT, 0);
+        init_maintenance();
+    }
+}
+
+// Newest arena of `kind` and `owner` for the calling thread's node, created on
+// first use
+static Arena *local_arena(int kind, int owner) {
+    int node = current_node();
+    Arena *arena = *newest_arena(node, kind, owner);
+    if (arena == NULL) {
+        return create_arena(node, kind, owner);
+    }
+    return arena;
+}
+
+// An exiting thread gives up its slot
+static void release_slot(void *arg) {
+    pthread_mutex_lock(&heap_lock);
+    slot_threads[(intptr_t)arg]--;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void create_slot_key() {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+// Slot of the calling thread, assigned on its first allocation once more than
+// one thread has allocated. 0 while the process is single-threaded.
+static int thread_owner() {
+    if (thread_slot > 0) return thread_slot;
+    if (thread_slot < 0) {
+        thread_slot = 0;
+        threads_seen++;
+    }
+    if (!thread_arenas || threads_seen < 2) return 0;
+
+    int slot = 1;
+    for (int i = 2; i <= MAX_THREAD_SLOTS; i++) {
+        if (slot_threads[i] < slot_threads[slot]) slot = i;
+    }
+    slot_threads[slot]++;
+    thread_slot = slot;
+    pthread_once(&slot_once, create_slot_key);
+    pthread_setspecific(slot_key, (void *)(intptr_t)slot);
+    return slot;
+}
+
+// Owner of the arenas a block of `block_size` and `kind` is taken from: the
+// thread's slot for small unhinted blocks, otherwise the shared arenas
+static int owner_for(size_t block_size, int kind) {
+    return kind == KIND_DEFAULT && block_size < TREE_MIN_SIZE ? thread_owner() : 0;
+}
+
+// Arena containing a heap block, or NULL
+static Arena *arena_of(Block *block) {
+    for (size_t i = 0; i < num_arenas; i++) {
+        char *start = arenas[i].start + kMetadataSize;
+        char *end = arenas[i].start + arena_size;
+        if ((char *)block >= start && (char *)block < end) return &arenas[i];
+    }
+    return NULL;
+}
+
+// Split block
+static void split_block(Arena *arena, Block *block, size_t size) {
+    size_t blockSize = get_block_size(block);
+    if (blockSize >= size + kBlockOverhead + kMinAllocationSize) {
+        Block *new_block = (Block *)((char *)block + size);
+        size_t new_block_size = blockSize - size;
+        set_block_size(new_block, new_block_size);
+        set_allocated(new_block, false);
+        set_fencepost(new_block, false);
+        set_mmaped(new_block, is_mmaped(block));
+        set_next(new_block, NULL);
+        set_prev(new_block, NULL);
+
+        // Footer
+        size_t *new_footer = get_footer(new_block);
+        *new_footer = new_block->size;
+
+        set_block_size(block, size);
+        size_t *block_footer = get_footer(block);
+        *block_footer = block->size;
+
+        add_to_free_list(arena, new_block);
+    }
+}
+
+// Split block from the end: the front stays on the free list and the tail of
+// `size` bytes is returned. Returns the whole block if it is too small to split.
+static Block *split_block_tail(Arena *arena, Block *block, size_t size) {
+    size_t blockSize = get_block_size(block);
+    if (blockSize < size + kBlockOverhead + kMinAllocationSize) return block;
+
+    set_block_size(block, blockSize - size);
+    size_t *block_footer = get_footer(block);
+    *block_footer = block->size;
+    add_to_free_list(arena, block);
+
+    Block *tail = (Block *)((char *)block + blockSize - size);
+    tail->size = 0;
+    set_block_size(tail, size);
+    set_mmaped(tail, is_mmaped(block));
+    size_t *tail_footer = get_footer(tail);
+    *tail_footer = tail->size;
+    return tail;
+}
+
+#ifdef ENABLE_HUGEPAGES
+// Split `size` bytes off the end of a free block. A tail that fits in a huge
+// page but would straddle a boundary ends at the boundary instead, and the
+// bytes past it go back to the free list, so the tail touches one huge page.
+static Block *take_tail(Arena *arena, Block *block, size_t size) {
+    char *end = (char *)block + get_block_size(block);
+    char *boundary = (char *)((uintptr_t)end & ~(HUGE_PAGE_SIZE - 1));
+    if (size <= HUGE_PAGE_SIZE && boundary > end - size &&
+        (size_t)(end - boundary) >= kBlockOverhead + kMinAllocationSize &&
+        boundary - size >= (char *)block) {
+        Block *tail = split_block_tail(arena, block, end - (boundary - size));
+        split_block(arena, tail, size);
+        return tail;
+    }
+    return split_block_tail(arena, block, size);
+}
+#endif
+
+// Size of the block map_block makes for `block_size` bytes. Without guard
+// pages it runs to the end of its last page, since the kernel maps whole pages.
+static size_t mapped_block_size(size_t block_size) {
+#ifdef ENABLE_GUARD_PAGES
+    return block_size;
+#else
+    init_page_size();
+    return ((block_size + 2 * kMetadataSize + page_size - 1) & ~(page_size - 1)) - 2 * kMetadataSize;
+#endif
+}
+
+#ifdef ENABLE_GUARD_PAGES
+// Map a block whose payload ends flush against a PROT_NONE guard page. The
+// start fencepost sits right before the block header; the guard page takes the
+// place of the footer and end fencepost, so an overrun faults immediately.
+static Block *map_block(size_t block_size, int node) {
+    init_page_size();
+    size_t payload = block_size - kBlockOverhead;
+    size_t span = (2 * kMetadataSize + payload + page_size - 1) & ~(page_size - 1);
+    size_t mmap_size = span + page_size;
+    void *mem = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    char *guard = (char *)mem + span;
+    if (mprotect(guard, page_size, PROT_NONE) != 0) {
+        munmap(mem, mmap_size);
+        return NULL;
+    }
+
+    bind_to_node(mem, mmap_size, node);
+    heap_size += mmap_size;
+    heap_reserved += mmap_size;
+
+    Block *new_block = (Block *)(guard - payload - kMetadataSize);
+    Block *start_fencepost = (Block *)((char *)new_block - kMetadataSize);
+    start_fencepost->size = 0;
+    set_allocated(start_fencepost, true);
+    set_fencepost(start_fencepost, true);
+    set_mmaped(start_fencepost, true);
+
+    // The footer slot is the first word of the guard page and is never written
+    new_block->size = 0;
+    set_block_size(new_block, block_size);
+    set_allocated(new_block, true);
+    set_mmaped(new_block, true);
+    return new_block;
+}
+
+// Make a freed guarded mapping inaccessible instead of unmapping it, so a use
+// after free faults. Only the oldest RETIRED_SLOTS mappings are kept.
+static void unmap_region(Block *block) {
+    Mapping m;
+    m.mem = (void *)(((uintptr_t)block - kMetadataSize) & ~(page_size - 1));
+    m.size = (size_t)((char *)block + get_block_size(block) - kFooterSize +
+                      page_size - (char *)m.mem);
+
+    // A retired mapping no longer holds memory, but keeps its address space
+    // until it is unmapped
+    madvise(m.mem, m.size, MADV_DONTNEED);
+    heap_size -= m.size;
+    if (mprotect(m.mem, m.size, PROT_NONE) != 0) {
+        munmap(m.mem, m.size);
+        heap_reserved -= m.size;
+        return;
+    }
+
+    if (retired_count == RETIRED_SLOTS) {
+        Mapping *oldest = &retired[retired_head];
+        munmap(oldest->mem, oldest->size);
+        heap_reserved -= oldest->size;
+        retired_head = (retired_head + 1) % RETIRED_SLOTS;
+        retired_count--;
+    }
+    retired[(retired_head + retired_count) % RETIRED_SLOTS] = m;
+    retired_count++;
+}
+#else
+// Map a block bracketed by its own pair of fenceposts
+static Block *map_block(size_t block_size, int node) {
+    size_t mmap_size = mapped_block_size(block_size) + 2 * kMetadataSize;
+    void *mem = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    bind_to_node(mem, mmap_size, node);
+    heap_size += mmap_size;
+    heap_reserved += mmap_size;
+
+    // Fenceposts
+    Block *start_fencepost = (Block *)mem;
+    start_fencepost->size = 0;
+    set_allocated(start_fencepost, true);
+    set_fencepost(start_fencepost, true);
+    set_mmaped(start_fencepost, true);
+
+    Block *end_fencepost = (Block *)((char *)mem + mmap_size - kMetadataSize);
+    end_fencepost->size = 0;
+    set_allocated(end_fencepost, true);
+    set_fencepost(end_fencepost, true);
+    set_mmaped(end_fencepost, true);
+
+    // Alloc block
+    Block *new_block = (Block *)((char *)mem + kMetadataSize);
+    set_block_size(new_block, mmap_size - 2 * kMetadataSize);
+    set_allocated(new_block, true);
+    set_fencepost(new_block, false);
+    set_mmaped(new_block, true);
+    size_t *footer = get_footer(new_block);
+    *footer = new_block->size;
+    return new_block;
+}
+
+static void unmap_region(Block *block) {
+    size_t mmap_size = get_block_size(block) + 2 * kMetadataSize;
+    void *mem = (char *)block - kMetadataSize;
+    munmap(mem, mmap_size);
+    heap_size -= mmap_size;
+    heap_reserved -= mmap_size;
+}
+#endif
+
+// Validate pointer
+static int is_valid_pointer(void *p) {
+    if (p == NULL) return 0;
+
+    Block *block = ptr_to_block(p);
+    if (((uintptr_t)block) % kAlignment != 0) return 0;
+
+    // Anything at or past the top has never been handed out
+    Arena *arena = arena_of(block);
+    if (arena != NULL) return block < arena->top;
+
+    Block *current = mmaped_blocks;
+    while (current != NULL) {
+        if (block == current) return 1;
+        current = get_next(current);
+    }
+
+    return 0;
+}
+
+// Start fencepost of a directly mapped block; it records the block's node
+static Block *mapping_fencepost(Block *block) {
+    return (Block *)((char *)block - kMetadataSize);
+}
+
+// Account for payload bytes handed out on `node`
+static void count_allocation(size_t payload_size, int node) {
+    current_memory_usage += payload_size;
+    node_usage[node] += payload_size;
+    if (current_memory_usage > peak_memory_usage) {
+        peak_memory_usage = current_memory_usage;
+    }
+}
+
+// Allocate a block of its own mapping, placed on `node`
+static void *allocate_mapped(size_t size, size_t block_size, int node) {
+#ifdef ENABLE_GUARD_PAGES
+    block_size = round_up(size + kBlockOverhead);
+#endif
+    // The whole mapping counts against the limits, not just the request
+    if (!within_limits(mapped_block_size(block_size) - kBlockOverhead)) return NULL;
+
+    Block *new_block = map_block(block_size, node);
+    if (new_block == NULL) {
+        LOG("Failed to mmap\n");
+        return NULL;
+    }
+    mapping_fencepost(new_block)->prev = (Block *)(uintptr_t)node;
+
+    // Track mmaped
+    set_next(new_block, mmaped_blocks);
+    if (mmaped_blocks != NULL) {
+        set_prev(mmaped_blocks, new_block);
+    }
+    set_prev(new_block, NULL);
+    mmaped_blocks = new_block;
+#ifdef ENABLE_HARDENED
+    arm_block(new_block, size);
+#endif
+
+    count_allocation(get_block_size(new_block) - kBlockOverhead, node);
+    return (char *)new_block + kMetadataSize;
+}
+
+// Search one arena with the placement policy. The block found is taken off
+// the free list and split down to `block_size` when the remainder is big
+// enough to be a block of its own. NULL if nothing there is big enough.
+static Block *take_block(Arena *arena, size_t block_size) {
+    Block *block = find_free(arena, block_size);
+    if (block == NULL) {
+        // Nothing free fits; grow into the wilderness
+        return carve_from_top(arena, block_size);
+    }
+
+    remove_from_free_list(arena, block);
+    size_t bsize = get_block_size(block);
+#ifdef ENABLE_HUGEPAGES
+    if (block_size >= TAIL_SPLIT_SIZE) {
+        return take_tail(arena, block, block_size);
+    }
+#endif
+    if (bsize - block_size >= kBlockOverhead + kMinAllocationSize) {
+        split_block(arena, block, block_size);
+    }
+    return block;
+}
+
+// Take `block_size` bytes from the caller's node first, then any other arena
+// of the same kind and owner, then a fresh arena. A thread slot that cannot
+// get an arena falls back to the shared ones. Sets `*found` to the arena the
+// block came from.
+static Block *find_block(size_t block_size, int kind, int owner, Arena **found) {
+    Arena *local = local_arena(kind, owner);
+    if (local != NULL) {
+        Block *block = take_block(local, block_size);
+        if (block != NULL) {
+            *found = local;
+            return block;
+        }
+    }
+    for (size_t i = 0; i < num_arenas; i++) {
+        if (&arenas[i] == local || arenas[i].kind != kind || arenas[i].owner != owner) continue;
+        Block *block = take_block(&arenas[i], block_size);
+        if (block != NULL) {
+            *found = &arenas[i];
+            return block;
+        }
+    }
+
+    // Grow the heap by reserving another arena
+    Arena *arena = create_arena(current_node(), kind, owner);
+    if (arena == NULL) {
+        return owner != 0 ? find_block(block_size, kind, 0, found) : NULL;
+    }
+    *found = arena;
+    return take_block(arena, block_size);
+}
+
+// Take a block whose payload starts on a cache line. `block_size` covers whole
+// lines of payload, so no other block's payload shares them. The bytes skipped
+// to align the header go back to the free list as a block of their own, and
+// there is always enough left behind the block to split off, so its usable
+// size ends on a line too.
+static Block *find_line_block(size_t block_size, int kind, Arena **found) {
+    size_t slack = CACHE_LINE + 2 * (kBlockOverhead + kMinAllocationSize);
+    Block *block = find_block(block_size + slack, kind, owner_for(block_size, kind), found);
+    if (block == NULL) return NULL;
+
+    uintptr_t payload = ((uintptr_t)block + kMetadataSize + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1);
+    size_t gap = payload - kMetadataSize - (uintptr_t)block;
+    if (gap != 0 && gap < kBlockOverhead + kMinAllocationSize) {
+        gap += CACHE_LINE;
+    }
+    if (gap != 0) {
+        block = split_block_tail(*found, block, get_block_size(block) - gap);
+    }
+    Arena *arena = *found;
+    char *end = (char *)block + get_block_size(block);
+    if (end == (char *)arena->top) {
+        // A block carved from the top gives its remainder back to the top,
+        // rather than leaving a free block beside it
+        Block *top = (Block *)((char *)block + block_size);
+        top->size = 0;
+        set_block_size(top, end - (char *)top + get_block_size(arena->top));
+        arena->top = top;
+        count_top_dirty(arena);
+        set_block_size(block, block_size);
+        *get_footer(block) = block->size;
+    } else {
+        split_block(arena, block, block_size);
+    }
+    return block;
+}
+
+/* Background maintenance */
+
+// The decay curve is tracked in this many steps of decay_ms / DECAY_STEPS
+#define DECAY_STEPS 100
+// A bin that sees this many requests in one step and has no free block gets
+// PRESPLIT_BLOCKS blocks carved ahead of demand
+#define PRESPLIT_MIN_REQUESTS 64
+#define PRESPLIT_BLOCKS 32
+// Free blocks one maintenance step purges at most per arena, so a large
+// backlog is spread over several steps instead of holding the lock
+#define PURGE_STEP_BLOCKS 256
+
+// Decay time in milliseconds; 0 leaves the thread off
+static size_t decay_ms = 0;
+// Bytes freed in each of the last DECAY_STEPS steps, newest at decay_head
+static size_t decay_ring[DECAY_STEPS];
+static size_t decay_head = 0;
+// Return whole granules in [from, to) to the OS, returning the bytes released
+static size_t purge_range(char *from, char *to) {
+    from = granule_up(from);
+    to = granule_down(to);
+    if (to <= from) return 0;
+    if (madvise(from, to - from, MADV_DONTNEED) != 0) return 0;
+    return to - from;
+}
+
+// Purge up to about `target` bytes of an arena, and at most `max_blocks` free
+// blocks: the wilderness first, then the oldest dirty blocks. Every block on
+// the dirty list has a whole page to give back, so the work done is bounded
+// by what is purged, and nothing purged means madvise failed. Memory it failed
+// on stays dirty, to be tried again on a later step. Returns the bytes
+// released.
+static size_t purge_arena(Arena *arena, size_t target, size_t max_blocks) {
+    size_t purged = 0;
+    char *top_start = (char *)arena->top + kMetadataSize;
+    if (arena->top_dirty != 0) {
+        char *clean = granule_up(arena->clean);
+        size_t released = purge_range(top_start, clean < arena->committed ? clean : arena->committed);
+        if (released == 0) return 0;
+        purged += released;
+        arena->clean = granule_up(top_start);
+        count_top_dirty(arena);
+    }
+
+    for (size_t n = 0; n < max_blocks && purged < target && arena->dirty_head != NULL; n++) {
+        Block *block = arena->dirty_head;
+        size_t released = purge_range(purgeable_start(block), purgeable_end(block));
+        if (released == 0) break;
+        purged += released;
+        dirty_remove(arena, block);
+        *purge_mark(block) = purge_mark_value(block);
+    }
+    return purged;
+}
+
+// jemalloc-style decay: bytes freed `age` steps ago may stay dirty in
+// proportion to 1 - smoothstep(age / DECAY_STEPS). Anything over that limit
+// is purged.
+static size_t decay_limit() {
+    double limit = 0;
+    for (size_t age = 0; age < DECAY_STEPS; age++) {
+        double x = (double)age / DECAY_STEPS;
+        double smoothstep = x * x * (3 - 2 * x);
+        limit += decay_ring[(decay_head + DECAY_STEPS - age) % DECAY_STEPS] * (1 - smoothstep);
+    }
+    return (size_t)limit;
+}
+
+// Carve a run of free blocks for the busiest small size of an arena that has
+// none left, so the next requests hit a bin instead of splitting
+static void presplit(Arena *arena) {
+    size_t hot = 0;
+    for (size_t bin = 0; bin < N_BINS; bin++) {
+        if (arena->requests[bin] > arena->requests[hot]) hot = bin;
+    }
+    bool busy = arena->requests[hot] >= PRESPLIT_MIN_REQUESTS;
+    memset(arena->requests, 0, sizeof(arena->requests));
+    // Only the size-ordered index keeps bins to hit
+    if (!busy || policy->insert != size_index_insert || arena->bins[hot] != NULL) return;
+
+    size_t size = hot * kAlignment;
+    Block *run = take_block(arena, PRESPLIT_BLOCKS * size);
+    if (run == NULL) return;
+    size_t run_size = get_block_size(run);
+    char *cursor = (char *)run;
+    for (size_t i = 0; i < PRESPLIT_BLOCKS; i++) {
+        Block *block = (Block *)cursor;
+        block->size = 0;
+        set_block_size(block, i == PRESPLIT_BLOCKS - 1 ? run_size - i * size : size);
+        size_t *footer = get_footer(block);
+        *footer = block->size;
+        add_to_free_list(arena, block);
+        cursor += size;
+    }
+}
+
+// Purge arenas until at most `limit` bytes may still be dirty, touching no
+// more than `max_blocks` free blocks in each
+static void purge_dirty(size_t limit, size_t max_blocks) {
+    for (size_t i = 0; i < num_arenas && dirty_bytes > limit; i++) {
+        purged_bytes += purge_arena(&arenas[i], dirty_bytes - limit, max_blocks);
+    }
+}
+
+// One maintenance step, with the heap lock held
+static void maintain() {
+    decay_head = (decay_head + 1) % DECAY_STEPS;
+    decay_ring[decay_head] = freed_bytes;
+    freed_bytes = 0;
+
+    for (size_t i = 0; i < num_arenas; i++) {
+        // Sort deferred large frees so allocations find them in the tree
+        sort_unsorted(&arenas[i]);
+        presplit(&arenas[i]);
+    }
+
+    purge_dirty(decay_limit(), PURGE_STEP_BLOCKS);
+}
+
+static void *maintenance_main(void *arg) {
+    size_t step_ns = decay_ms * 1000000 / DECAY_STEPS;
+    if (step_ns < 1000000) step_ns = 1000000;
+    struct timespec step = {step_ns / 1000000000, step_ns % 1000000000};
+    for (;;) {
+        nanosleep(&step, NULL);
+        pthread_mutex_lock(&heap_lock);
+        maintain();
+        pthread_mutex_unlock(&heap_lock);
+    }
+    return NULL;
+}
+
+// Start the maintenance thread when MYMALLOC_DECAY_MS is set. It does all the
+// purging, sorting and pre-splitting, so my_malloc and my_free never do.
+static void init_maintenance() {
+    const char *env = getenv("MYMALLOC_DECAY_MS");
+    if (env == NULL) return;
+    decay_ms = strtoul(env, NULL, 10);
+    if (decay_ms == 0) return;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, maintenance_main, NULL) != 0) {
+        LOG("Failed to start the maintenance thread\n");
+        decay_ms = 0;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* Memory limits */
+
+// Limits on allocated bytes, from MYMALLOC_SOFT_LIMIT and MYMALLOC_HARD_LIMIT
+// or my_malloc_set_limits; 0 means no limit
+static size_t soft_limit = 0;
+static size_t hard_limit = 0;
+// The soft limit fires once per crossing. It re-arms when usage falls back
+// under 7/8 of the limit, so usage hovering at the limit does not flood the
+// callbacks.
+static bool soft_armed = true;
+static MyPressureCallback pressure_callbacks[MAX_PRESSURE_CALLBACKS];
+static void *pressure_args[MAX_PRESSURE_CALLBACKS];
+static size_t num_pressure_callbacks = 0;
+// Highest level raised since the callbacks last ran, 0 if none. Written with
+// the heap lock held, read without it on the way out of my_malloc.
+static int pressure_pending = 0;
+static size_t pressure_events = 0;
+static size_t limit_failures = 0;
+// Set while this thread runs the callbacks, so pressure they cause waits
+static __thread bool in_pressure_callback = false;
+
+static void init_limits() {
+    const char *env = getenv("MYMALLOC_SOFT_LIMIT");
+    if (env != NULL) soft_limit = parse_size(env);
+    env = getenv("MYMALLOC_HARD_LIMIT");
+    if (env != NULL) hard_limit = parse_size(env);
+}
+
+static void raise_pressure(int level) {
+    // Give back every free page before the application is asked to
+    purge_dirty(0, SIZE_MAX);
+    if (level > pressure_pending) {
+        __atomic_store_n(&pressure_pending, level, __ATOMIC_RELAXED);
+    }
+}
+
+// Whether `payload` more allocated bytes stay within the hard limit, with the
+// heap lock held. Crossing either limit purges and queues the callbacks.
+static bool within_limits(size_t payload) {
+    size_t usage = current_memory_usage + payload;
+    if (soft_limit != 0) {
+        if (usage > soft_limit && soft_armed) {
+            soft_armed = false;
+            pressure_events++;
+            raise_pressure(MY_PRESSURE_SOFT);
+        } else if (!soft_armed && usage < soft_limit - soft_limit / 8) {
+            soft_armed = true;
+        }
+    }
+    if (hard_limit != 0 && usage > hard_limit) {
+        limit_failures++;
+        raise_pressure(MY_PRESSURE_HARD);
+        return false;
+    }
+    return true;
+}
+
+// Run the registered callbacks for the pending level, without the heap lock
+static void run_pressure_callbacks() {
+    if (in_pressure_callback) return;
+
+    MyPressureCallback callbacks[MAX_PRESSURE_CALLBACKS];
+    void *args[MAX_PRESSURE_CALLBACKS];
+    pthread_mutex_lock(&heap_lock);
+    int level = pressure_pending;
+    __atomic_store_n(&pressure_pending, 0, __ATOMIC_RELAXED);
+    size_t n = num_pressure_callbacks;
+    memcpy(callbacks, pressure_callbacks, n * sizeof(callbacks[0]));
+    memcpy(args, pressure_args, n * sizeof(args[0]));
+    size_t usage = current_memory_usage;
+    pthread_mutex_unlock(&heap_lock);
+    if (level == 0) return;
+
+    in_pressure_callback = true;
+    for (size_t i = 0; i < n; i++) {
+        callbacks[i]((MyPressureLevel)level, usage, args[i]);
+    }
+    in_pressure_callback = false;
+}
+
+static bool pressure_raised() {
+    return __atomic_load_n(&pressure_pending, __ATOMIC_RELAXED) != 0;
+}
+
+// Mark a block taken from an arena as allocated and return its payload
+static void *claim_block(Block *block, size_t size) {
+    set_allocated(block, true);
+    size_t *footer = get_footer(block);
+    *footer = block->size;
+    if (get_block_size(block) >= PURGE_MIN_BLOCK) {
+        *purge_mark(block) = 0;
+    }
+#ifdef ENABLE_HARDENED
+    arm_block(block, size);
+#endif
+    return (char *)block + kMetadataSize;
+}
+
+// Allocate from arenas of `kind` with the heap lock held. A `line` block is
+// padded to whole cache lines and aligned to one.
+static void *allocate(size_t size, int kind, bool line) {
+    init_heap();
+    if (line) {
+        size = ((size + CANARY_SIZE + CACHE_LINE - 1) & ~(CACHE_LINE - 1)) - CANARY_SIZE;
+    }
+    size_t block_size = round_up(size + kBlockOverhead + CANARY_SIZE);
+
+    // Large allocs via mmap
+    if (block_size > mmap_threshold) {
+        return allocate_mapped(size, block_size, current_node());
+    }
+
+    Arena *arena;
+    Block *block = line ? find_line_block(block_size, kind, &arena)
+                         : find_block(block_size, kind, owner_for(block_size, kind), &arena);
+    if (block == NULL) {
+        // Couldn't find block
+        return NULL;
+    }
+    // The block may keep a remainder too small to split off, and that counts
+    // against the limits too
+    if (!within_limits(get_block_size(block) - kBlockOverhead)) {
+        release_block(arena, block);
+        return NULL;
+    }
+    if (block_size < TREE_MIN_SIZE) {
+        arena->requests[bin_index(block_size)]++;
+    }
+    count_allocation(get_block_size(block) - kBlockOverhead, arena->node);
+    return claim_block(block, size);
+}
+
+// Allocate under the heap lock, then run the pressure callbacks if the
+// allocation raised pressure
+static void *lock_and_allocate(size_t size, int kind, bool line) {
+    if (size == 0 || size > kMaxAllocationSize) return NULL;
+
+    pthread_mutex_lock(&heap_lock);
+    void *p = allocate(size, kind, line);
+    pthread_mutex_unlock(&heap_lock);
+
+    if (pressure_raised()) {
+        run_pressure_callbacks();
+        // The callbacks may have freed enough for a refused request
+        if (p == NULL) {
+            pthread_mutex_lock(&heap_lock);
+            int pending = pressure_pending;
+            p = allocate(size, kind, line);
+            if (p == NULL) {
+                // The callbacks already ran for this request; a refused
+                // retry must not run them again on the next allocation
+                __atomic_store_n(&pressure_pending, pending, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&heap_lock);
+        }
+    }
+    return p;
+}
+
+// Malloc implementation
+void *my_malloc(size_t size) {
+    return lock_and_allocate(size, KIND_DEFAULT, false);
+}
+
+// Allocate from the arenas kept for one placement hint. Short-lived blocks
+// churn among themselves and coalesce back into their arena's top, so they
+// never leave holes between long-lived blocks; hot blocks pack densely into
+// as few pages as possible. When several hints are given, SHORT_LIVED wins
+// over HOT, and HOT over LONG_LIVED. CACHELINE combines with any of them and
+// gives the block cache lines of its own.
+void *my_malloc_hint(size_t size, unsigned hints) {
+    int kind = hints & MY_HINT_SHORT_LIVED ? KIND_SHORT_LIVED
+             : hints & MY_HINT_HOT        ? KIND_HOT
+             : hints & MY_HINT_LONG_LIVED ? KIND_LONG_LIVED
+                                          : KIND_DEFAULT;
+    return lock_and_allocate(size, kind, hints & MY_HINT_CACHELINE);
+}
+
+// Bytes the caller may use at `p`, which is often more than it asked for: a
+// remainder too small to split off stays with its block, and a directly
+// mapped block runs to the end of its last page. `p` must be a live block
+// from this allocator. Hardened builds report the requested size, since the
+// tail canary follows it.
+size_t my_malloc_usable_size(void *p) {
+    if (p == NULL) return 0;
+
+    Block *block = ptr_to_block(p);
+#ifdef ENABLE_HARDENED
+    return block->requested;
+#else
+    return get_block_size(block) - kBlockOverhead;
+#endif
+}
+
+// Size to ask for so that a buffer wastes nothing, whichever path serves it:
+// the size class for requests the thread cache serves, since an inline
+// my_malloc hands out the whole class, otherwise the request rounded up to the
+// alignment, or to the end of the last page for a directly mapped block.
+// my_malloc of a good size always has all of it usable. 0 when the request
+// would fail.
+size_t my_malloc_good_size(size_t size) {
+    if (size == 0 || size > kMaxAllocationSize) return 0;
+#ifdef ENABLE_HARDENED
+    return size;
+#else
+    if (size <= MY_TCACHE_MAX_SIZE) return MY_CLASS_SIZE(MY_CLASS_OF(size));
+    size_t block_size = round_up(size + kBlockOverhead);
+#ifndef ENABLE_GUARD_PAGES
+    // The threshold follows the arena size, which is read on first use
+    pthread_mutex_lock(&heap_lock);
+    init_heap();
+    bool mapped = block_size > mmap_threshold;
+    pthread_mutex_unlock(&heap_lock);
+    if (mapped) {
+        block_size = mapped_block_size(block_size);
+    }
+#endif
+    return block_size - kBlockOverhead;
+#endif
+}
+
+// Allocate `n` blocks of `size` bytes into `out`, returning how many were
+// allocated. The blocks are carved back to back from a single free region when
+// one is big enough, so the whole batch costs one search and one split.
+size_t my_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0 || size > kMaxAllocationSize || n == 0) return 0;
+
+    pthread_mutex_lock(&heap_lock);
+    init_heap();
+    size_t block_size = round_up(size + kBlockOverhead + CANARY_SIZE);
+    size_t done = 0;
+
+    Arena *arena;
+    Block *run = NULL;
+    if (block_size <= mmap_threshold / n) {
+        run = find_block(n * block_size, KIND_DEFAULT, owner_for(block_size, KIND_DEFAULT), &arena);
+    }
+    if (run != NULL && !within_limits(get_block_size(run) - n * kBlockOverhead)) {
+        release_block(arena, run);
+        run = NULL;
+    }
+    if (run != NULL) {
+        // Any slack the split left over goes to the last block
+        size_t run_size = get_block_size(run);
+        char *cursor = (char *)run;
+        for (; done < n; done++) {
+            Block *block = (Block *)cursor;
+            block->size = 0;
+            set_block_size(block, done == n - 1 ? run_size - done * block_size : block_size);
+            out[done] = claim_block(block, size);
+            cursor += block_size;
+        }
+        count_allocation(run_size - n * kBlockOverhead, arena->node);
+    }
+
+    // No region holds the whole batch; fall back to one block at a time
+    for (; done < n; done++) {
+        out[done] = allocate(size, KIND_DEFAULT, false);
+        if (out[done] == NULL) break;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (pressure_raised()) {
+        run_pressure_callbacks();
+    }
+    return done;
+}
+
+// Return an mmaped block to the OS
+static void unmap_block(Block *block) {
+    Block *next = get_next(block);
+    Block *prev = get_prev(block);
+    if (prev != NULL) {
+        set_next(prev, next);
+    } else {
+        mmaped_blocks = next;
+    }
+    if (next != NULL) {
+        set_prev(next, prev);
+    }
+
+    unmap_region(block);
+}
+
+// Mark a heap block free, coalesce it with its neighbours and list it. A block
+// that reaches the top is absorbed into the wilderness instead.
+static void release_block(Arena *arena, Block *block) {
+    set_allocated(block, false);
+    // Whatever the free adds to the dirty pages counts towards the decay
+    size_t dirty_before = dirty_bytes;
+
+    // Coalesce
+    Block *next = (Block *)((char *)block + get_block_size(block));
+    bool into_top = next == arena->top;
+    if (into_top) {
+        set_block_size(block, get_block_size(block) + get_block_size(next));
+    } else if (!is_allocated(next) && !is_fencepost(next)) {
+        remove_from_free_list(arena, next);
+        size_t new_size = get_block_size(block) + get_block_size(next);
+        set_block_size(block, new_size);
+    }
+
+    Block *prev = get_prev_block(block);
+    if (prev && !is_allocated(prev) && !is_fencepost(prev)) {
+        remove_from_free_list(arena, prev);
+        size_t new_size = get_block_size(prev) + get_block_size(block);
+        set_block_size(prev, new_size);
+        block = prev;
+    }
+
+    if (into_top) {
+        arena->top = block;
+        count_top_dirty(arena);
+    } else {
+        size_t *footer = get_footer(block);
+        *footer = block->size;
+        add_to_free_list(arena, block);
+    }
+    if (dirty_bytes > dirty_before) {
+        freed_bytes += dirty_bytes - dirty_before;
+    }
+}
+
+#ifndef ENABLE_HARDENED
+// Forget which thread cache handed out an arena block that is being freed.
+// Otherwise the stamp could survive a merge into a neighbour or the top, and
+// a block later carved at the same place would be cached by that thread.
+static void clear_tcache_stamp(Block *block) {
+    block->prev = NULL;
+}
+#endif
+
+// Free a live block with the heap lock held. `mapped` says whether it has a
+// mapping of its own or lives in an arena.
+static void free_block(Block *block, bool mapped) {
+    if (free_hook != NULL) free_hook((char *)block + kMetadataSize);
+    size_t payload_size = get_block_size(block) - kBlockOverhead;
+    current_memory_usage -= payload_size;
+
+    if (mapped) {
+        node_usage[(uintptr_t)mapping_fencepost(block)->prev] -= payload_size;
+        // Unmap mmaped
+        unmap_block(block);
+        return;
+    }
+
+    Arena *arena = arena_of(block);
+    node_usage[arena->node] -= payload_size;
+#ifdef ENABLE_HARDENED
+    block = quarantine_push(block);
+    if (block == NULL) return;
+    arena = arena_of(block);
+#else
+    clear_tcache_stamp(block);
+#endif
+    release_block(arena, block);
+}
+
+// Free with the heap lock held
+static void deallocate(void *p) {
+    if (!is_valid_pointer(p)) return;
+
+    Block *block = ptr_to_block(p);
+#ifdef ENABLE_HARDENED
+    check_block(block);
+#else
+    if (!is_allocated(block)) return;
+#endif
+    free_block(block, is_mmaped(block));
+}
+
+// Free implementation
+void my_free(void *p) {
+    if (p == NULL) return;
+
+    pthread_mutex_lock(&heap_lock);
+    deallocate(p);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+#ifdef CHECK_SIZED_FREE
+// Abort unless `p` is a live block that was allocated with `size` bytes
+static void check_sized_free(void *p, size_t size) {
+    if (!is_valid_pointer(p)) heap_corruption("free_sized of invalid pointer", p);
+
+    Block *block = ptr_to_block(p);
+#ifdef ENABLE_HARDENED
+    check_block(block);
+    if (block->requested != size) heap_corruption("free_sized with wrong size", p);
+#else
+    if (!is_allocated(block)) heap_corruption("double free", p);
+    // Anything from the requested size up to the usable size is accepted. A
+    // block can be bigger than its request by a remainder too small to split
+    // off, and a MY_HINT_CACHELINE block by the padding to its last line.
+    size_t block_size = round_up(size + kBlockOverhead + CANARY_SIZE);
+    size_t slack = kBlockOverhead + kMinAllocationSize;
+    if ((uintptr_t)p % CACHE_LINE == 0) slack += CACHE_LINE;
+    bool wrong = is_mmaped(block) ? block_size <= mmap_threshold
+                                  : block_size + slack < get_block_size(block);
+    if (wrong || get_block_size(block) < block_size) {
+        heap_corruption("free_sized with wrong size", p);
+    }
+#endif
+}
+#endif
+
+// Free a block the caller knows was allocated with `size` bytes, or with any
+// size up to my_malloc_usable_size. The pointer is not validated, so the
+// mmaped list is never walked. The block's own flag decides between the
+// mapped and arena paths: an arena block freed with its usable size can look
+// big enough to have been mapped. Checked builds verify the size.
+void my_free_sized(void *p, size_t size) {
+    if (p == NULL) return;
+
+    pthread_mutex_lock(&heap_lock);
+#ifdef CHECK_SIZED_FREE
+    check_sized_free(p, size);
+#endif
+    Block *block = ptr_to_block(p);
+    free_block(block, is_mmaped(block));
+    pthread_mutex_unlock(&heap_lock);
+}
+
+#ifndef ENABLE_HARDENED
+// Order pointers by address for my_free_batch
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+#endif
+
+// Free `n` pointers at once. The array is sorted by address in place so runs
+// of adjacent blocks are merged in a single pass and each run is coalesced and
+// listed once.
+void my_free_batch(void **ptrs, size_t n) {
+    pthread_mutex_lock(&heap_lock);
+#ifdef ENABLE_HARDENED
+    // Every block still goes through the checks and the quarantine
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) deallocate(ptrs[i]);
+    }
+#else
+    qsort(ptrs, n, sizeof(void *), compare_addresses);
+
+    size_t freed[MAX_NUMA_NODES] = {0};
+    Block *run = NULL;
+    Arena *run_arena = NULL;
+    for (size_t i = 0; i < n; i++) {
+        void *p = ptrs[i];
+        if (p == NULL || (i > 0 && p == ptrs[i - 1]) || !is_valid_pointer(p)) continue;
+
+        Block *block = ptr_to_block(p);
+        if (!is_allocated(block)) continue;
+        if (free_hook != NULL) free_hook(p);
+        size_t payload_size = get_block_size(block) - kBlockOverhead;
+
+        if (is_mmaped(block)) {
+            freed[(uintptr_t)mapping_fencepost(block)->prev] += payload_size;
+            unmap_block(block);
+            continue;
+        }
+
+        Arena *arena = arena_of(block);
+        freed[arena->node] += payload_size;
+        clear_tcache_stamp(block);
+        if (run != NULL && arena == run_arena &&
+            (char *)run + get_block_size(run) == (char *)block) {
+            set_block_size(run, get_block_size(run) + get_block_size(block));
+            continue;
+        }
+        if (run != NULL) {
+            release_block(run_arena, run);
+        }
+        run = block;
+        run_arena = arena;
+    }
+    if (run != NULL) {
+        release_block(run_arena, run);
+    }
+
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        current_memory_usage -= freed[node];
+        node_usage[node] -= freed[node];
+    }
+#endif
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Thread cache */
+
+// Blocks each class list may hold, and how many a refill takes at once
+#define TCACHE_LIMIT 64
+#define TCACHE_REFILL 16
+
+__thread MyThreadCache my_tcache __attribute__((tls_model("initial-exec")));
+
+#ifndef ENABLE_HARDENED
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+// Every enabled cache, so the collector can treat their blocks as roots
+static MyThreadCache *tcaches = NULL;
+
+// Pop `n` blocks off a class list and free them as one batch
+static void tcache_drain(MyThreadCache *cache, unsigned cls, unsigned n) {
+    void *batch[TCACHE_LIMIT];
+    for (unsigned i = 0; i < n; i++) {
+        batch[i] = cache->head[cls];
+        cache->head[cls] = *(void **)batch[i];
+    }
+    cache->count[cls] -= n;
+    my_free_batch(batch, n);
+}
+
+// Return an exiting thread's cached blocks to the heap
+static void tcache_release(void *arg) {
+    MyThreadCache *cache = arg;
+    cache->limit = 0;
+    for (unsigned cls = 0; cls < MY_TCACHE_CLASSES; cls++) {
+        tcache_drain(cache, cls, cache->count[cls]);
+    }
+    pthread_mutex_lock(&heap_lock);
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        tcaches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void tcache_create_key() {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+#endif
+
+// Cache miss: carve a batch of blocks for the class of `size`, keep all but
+// one in the cache and return that one. Enables the cache on first use.
+void *my_tcache_refill(size_t size) {
+#ifdef ENABLE_HARDENED
+    // Every block goes through the checked path
+    return my_malloc(size);
+#else
+    if (my_tcache.limit == 0) {
+        pthread_once(&tcache_once, tcache_create_key);
+        pthread_setspecific(tcache_key, &my_tcache);
+        pthread_mutex_lock(&heap_lock);
+        my_tcache.prev = NULL;
+        my_tcache.next = tcaches;
+        if (tcaches != NULL) {
+            tcaches->prev = &my_tcache;
+        }
+        tcaches = &my_tcache;
+        pthread_mutex_unlock(&heap_lock);
+        my_tcache.limit = TCACHE_LIMIT;
+    }
+
+    unsigned cls = MY_SIZE_CLASS(size);
+    void *batch[TCACHE_REFILL];
+    size_t n = my_malloc_batch(MY_CLASS_SIZE(cls), TCACHE_REFILL, batch);
+    if (n == 0) return NULL;
+    for (size_t i = 0; i < n; i++) {
+        ptr_to_block(batch[i])->prev = MY_TCACHE_STAMP;
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+        *(void **)batch[i] = my_tcache.head[cls];
+        my_tcache.head[cls] = batch[i];
+    }
+    my_tcache.count[cls] += n - 1;
+    return batch[0];
+#endif
+}
+
+// Full list: free half of it back to the heap, then cache `p`
+void my_tcache_flush(void *p, unsigned cls) {
+#ifndef ENABLE_HARDENED
+    if (my_tcache.limit != 0) {
+        tcache_drain(&my_tcache, cls, my_tcache.count[cls] / 2);
+        *(void **)p = my_tcache.head[cls];
+        my_tcache.head[cls] = p;
+        my_tcache.count[cls]++;
+        return;
+    }
+#endif
+    my_free(p);
+}
+
+/* Regions */
+
+// Default bytes per region chunk, chunk header included
+#define REGION_CHUNK_SIZE (64ull << 10)
+
+// A chunk of region memory, obtained from my_malloc. Objects are bumped out
+// of the bytes that follow this header.
+typedef struct RegionChunk RegionChunk;
+
+struct RegionChunk {
+    RegionChunk *next;
+    // Usable bytes after the header
+    size_t size;
+};
+
+struct Region {
+    // All chunks, in the order they are bumped through
+    RegionChunk *first;
+    RegionChunk *current;
+    // Free space left in the current chunk
+    char *cursor;
+    char *limit;
+    size_t chunk_size;
+};
+
+// Make `chunk` the one objects are bumped out of
+static void use_chunk(Region *region, RegionChunk *chunk) {
+    region->current = chunk;
+    region->cursor = (char *)(chunk + 1);
+    region->limit = region->cursor + chunk->size;
+}
+
+// Allocate a chunk with room for at least `size` bytes
+static RegionChunk *new_chunk(Region *region, size_t size) {
+    size_t chunk_size = region->chunk_size;
+    if (size + sizeof(RegionChunk) > chunk_size) {
+        chunk_size = size + sizeof(RegionChunk);
+    }
+    RegionChunk *chunk = my_malloc(chunk_size);
+    if (chunk == NULL) return NULL;
+    chunk->next = NULL;
+    chunk->size = chunk_size - sizeof(RegionChunk);
+    return chunk;
+}
+
+// Create a region whose chunks are `chunk_size` bytes, or a default when 0.
+// The first chunk is allocated up front.
+Region *my_region_create(size_t chunk_size) {
+    if (chunk_size == 0) chunk_size = REGION_CHUNK_SIZE;
+    chunk_size = round_up(chunk_size);
+    if (chunk_size <= sizeof(RegionChunk) || chunk_size > kMaxAllocationSize) return NULL;
+
+    Region *region = my_malloc(sizeof(Region));
+    if (region == NULL) return NULL;
+    region->chunk_size = chunk_size;
+    region->first = new_chunk(region, 0);
+    if (region->first == NULL) {
+        my_free(region);
+        return NULL;
+    }
+    use_chunk(region, region->first);
+    return region;
+}
+
+// Bump-allocate `size` bytes. Objects carry no header and cannot be freed
+// one at a time; they all go at the next reset or destroy. A region must not
+// be used from several threads at once.
+void *my_region_alloc(Region *region, size_t size) {
+    if (size == 0 || size > kMaxAllocationSize - sizeof(RegionChunk)) return NULL;
+    size = round_up(size);
+
+    if ((size_t)(region->limit - region->cursor) < size) {
+        // Move on to the next chunk kept from before a reset when it has
+        // room, otherwise slot a new chunk in after the current one
+        RegionChunk *next = region->current->next;
+        if (next == NULL || next->size < size) {
+            RegionChunk *chunk = new_chunk(region, size);
+            if (chunk == NULL) return NULL;
+            chunk->next = next;
+            region->current->next = chunk;
+            next = chunk;
+        }
+        use_chunk(region, next);
+    }
+
+    void *p = region->cursor;
+    region->cursor += size;
+    return p;
+}
+
+// Drop every object in the region at once. The chunks are kept, so a region
+// reused for the same workload stops calling into the heap.
+void my_region_reset(Region *region) {
+    use_chunk(region, region->first);
+}
+
+// Return all of the region's chunks to the heap
+void my_region_destroy(Region *region) {
+    if (region == NULL) return;
+    RegionChunk *chunk = region->first;
+    while (chunk != NULL) {
+        RegionChunk *next = chunk->next;
+        my_free_sized(chunk, chunk->size + sizeof(RegionChunk));
+        chunk = next;
+    }
+    my_free(region);
+}
+
+/* Collector support */
+
+void my_heap_lock(void) {
+    pthread_mutex_lock(&heap_lock);
+}
+
+void my_heap_unlock(void) {
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// Fill `out` with up to `max` segments, arenas first, and return how many
+// there are in all, so a caller can size its buffer with max = 0
+size_t my_heap_segments(MyHeapSegment *out, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; i < num_arenas; i++, n++) {
+        if (n < max) {
+            out[n].first = (Block *)(arenas[i].start + kMetadataSize);
+            out[n].end = (char *)arenas[i].top;
+            out[n].mapped = false;
+        }
+    }
+    for (Block *block = mmaped_blocks; block != NULL; block = get_next(block), n++) {
+        if (n < max) {
+            out[n].first = block;
+            out[n].end = (char *)block + get_block_size(block);
+            out[n].mapped = true;
+        }
+    }
+    return n;
+}
+
+// Fill `out` with up to `max` enabled thread caches and return how many there
+// are in all
+size_t my_thread_caches(MyThreadCache **out, size_t max) {
+    size_t n = 0;
+#ifndef ENABLE_HARDENED
+    for (MyThreadCache *cache = tcaches; cache != NULL; cache = cache->next, n++) {
+        if (n < max) {
+            out[n] = cache;
+        }
+    }
+#endif
+    return n;
+}
+
+void my_heap_set_free_hook(MyFreeHook hook) {
+    pthread_mutex_lock(&heap_lock);
+    free_hook = hook;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// Whether a block met on a walk belongs to the program. Quarantined blocks
+// keep their allocated bit but have already been freed.
+int my_block_is_live(Block *block) {
+#ifdef ENABLE_HARDENED
+    return is_allocated(block) && block->cookie == block_cookie(block, COOKIE_LIVE);
+#else
+    return is_allocated(block);
+#endif
+}
+
+/* Helper functions */
+
+// Check if free
+int is_free(Block *block) {
+    return !is_allocated(block);
+}
+
+// Get block size
+size_t block_size(Block *block) {
+    return get_block_size(block);
+}
+
+// Start block
+Block *get_start_block(void) {
+    return (Block *)heap_start;
+}
+
+// Next block
+Block *get_next_block(Block *block) {
+    if (block == NULL || is_fencepost(block)) return NULL;
+    Arena *arena = arena_of(block);
+    if (arena != NULL && block == arena->top) return NULL;
+    Block *next_block = (Block *)((char *)block + get_block_size(block));
+    if (is_fencepost(next_block) || get_block_size(next_block) == 0) return NULL;
+    return next_block;
+}
+
+// Ptr to block
+Block *ptr_to_block(void *ptr) {
+    if (ptr == NULL) return NULL;
+    return (Block *)((char *)ptr - kMetadataSize);
+}
+
+// Stats
+size_t get_peak_memory_usage() {
+    return peak_memory_usage;
+}
+
+// Committed bytes
+size_t get_heap_size() {
+    return heap_size;
+}
+
+// Reserved address space, committed or not
+size_t get_heap_reserved_size() {
+    return heap_reserved;
+}
+
+void my_malloc_stats(MallocStats *stats) {
+    pthread_mutex_lock(&heap_lock);
+    stats->current_usage = current_memory_usage;
+    stats->peak_usage = peak_memory_usage;
+    stats->heap_size = heap_size;
+    stats->heap_reserved = heap_reserved;
+    stats->numa_nodes = numa_nodes;
+    stats->policy = policy->name;
+    stats->purged = purged_bytes;
+    stats->soft_limit = soft_limit;
+    stats->hard_limit = hard_limit;
+    stats->pressure_events = pressure_events;
+    stats->limit_failures = limit_failures;
+    memcpy(stats->node_usage, node_usage, sizeof(node_usage));
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// Set the soft and hard limits on allocated bytes, replacing any from the
+// environment. 0 removes a limit.
+void my_malloc_set_limits(size_t soft, size_t hard) {
+    pthread_mutex_lock(&heap_lock);
+    init_heap();
+    soft_limit = soft;
+    hard_limit = hard;
+    soft_armed = true;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// Register a callback for memory pressure. Returns 0, or -1 when
+// MAX_PRESSURE_CALLBACKS are already registered.
+int my_malloc_add_pressure_callback(MyPressureCallback callback, void *arg) {
+    pthread_mutex_lock(&heap_lock);
+    int result = -1;
+    if (num_pressure_callbacks < MAX_PRESSURE_CALLBACKS) {
+        pressure_callbacks[num_pressure_callbacks] = callback;
+        pressure_args[num_pressure_callbacks] = arg;
+        num_pressure_callbacks++;
+        result = 0;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return result;
 }
@@ -14,8 +14,17 @@
 
 #define N_LISTS 59
 
+// Upper bound on the NUMA nodes that get an arena of their own
+#define MAX_NUMA_NODES 8
+
 #define ADD_BYTES(ptr, n) ((void *) (((char *) (ptr)) + (n)))
 
+// Flags kept in the low bits of Block.size
+#define ALLOCATED_FLAG 0x1
+#define FENCEPOST_FLAG 0x2
+#define MMAPED_FLAG    0x4
+#define SIZE_MASK      ~(ALLOCATED_FLAG | FENCEPOST_FLAG | MMAPED_FLAG)
+
 // Block structure with a unified header and footer, utilizing boundary tags
 typedef struct Block Block;
 
@@ -25,6 +34,12 @@ struct Block {
     // Next and Prev blocks in the free list (only used when the block is free)
     Block *next;
     Block *prev;
+#ifdef ENABLE_HARDENED
+    // Requested payload size, used to place the tail canary
+    size_t requested;
+    // Keyed checksum over the header, verified on free
+    size_t cookie;
+#endif
     // The footer is not explicitly stored as a separate field; it uses the last 8 bytes of the block.
 };
 
@@ -39,8 +54,198 @@ extern const size_t kMaxAllocationSize;
 // Memory size that is mmapped (64 MB)
 extern const size_t kMemorySize;
 
+// Allocator statistics, filled in by my_malloc_stats
+typedef struct {
+    // Payload bytes currently allocated, and the highest it has been
+    size_t current_usage;
+    size_t peak_usage;
+    // Bytes committed, and address space reserved, for arenas and large blocks
+    size_t heap_size;
+    size_t heap_reserved;
+    // NUMA nodes in use, and payload bytes currently allocated on each
+    int numa_nodes;
+    size_t node_usage[MAX_NUMA_NODES];
+    // Placement policy in use: "best", "first", "next" or "good"
+    const char *policy;
+    // Bytes of free pages returned to the OS, by the maintenance thread or
+    // under memory pressure
+    size_t purged;
+    // Limits on allocated bytes (0 if unset), times usage crossed the soft
+    // limit, and allocations refused at the hard limit
+    size_t soft_limit;
+    size_t hard_limit;
+    size_t pressure_events;
+    size_t limit_failures;
+} MallocStats;
+
+// Memory pressure levels passed to pressure callbacks
+typedef enum {
+    // Usage crossed the soft limit; the allocation went ahead
+    MY_PRESSURE_SOFT = 1,
+    // An allocation was refused at the hard limit and is retried once after
+    // the callbacks return
+    MY_PRESSURE_HARD = 2,
+} MyPressureLevel;
+
+// Called without the heap lock held, so it may free (or allocate) memory.
+// `usage` is the allocated bytes when the pressure was seen.
+typedef void (*MyPressureCallback)(MyPressureLevel level, size_t usage, void *arg);
+
+// Upper bound on registered pressure callbacks
+#define MAX_PRESSURE_CALLBACKS 8
+
+// Bump allocator whose objects are all freed together, see my_region_create
+typedef struct Region Region;
+
+// Placement hints for my_malloc_hint
+#define MY_HINT_SHORT_LIVED 0x1
+#define MY_HINT_LONG_LIVED  0x2
+#define MY_HINT_HOT         0x4
+// Start the block on a cache line and pad it to whole lines, so no other
+// block shares them
+#define MY_HINT_CACHELINE   0x8
+
 void *my_malloc(size_t size);
+void *my_malloc_hint(size_t size, unsigned hints);
 void my_free(void *p);
+void my_free_sized(void *p, size_t size);
+size_t my_malloc_usable_size(void *p);
+size_t my_malloc_good_size(size_t size);
+size_t my_malloc_batch(size_t size, size_t n, void **out);
+void my_free_batch(void **ptrs, size_t n);
+void my_malloc_stats(MallocStats *stats);
+void my_malloc_set_limits(size_t soft_limit, size_t hard_limit);
+int my_malloc_add_pressure_callback(MyPressureCallback callback, void *arg);
+
+Region *my_region_create(size_t chunk_size);
+void *my_region_alloc(Region *region, size_t size);
+void my_region_reset(Region *region);
+void my_region_destroy(Region *region);
+
+/* Thread cache. Each thread keeps short LIFO lists of free blocks for small
+   size classes; the lists are threaded through the first payload word. Blocks
+   in a cache still count as allocated in the stats. Hardened builds never
+   enable the cache, so every call there takes the out-of-line path. A refill
+   stamps its blocks with the thread's cache in the `prev` header field, which
+   an allocated block does not use, and only stamped blocks are cached again
+   on free. Any other block, such as one another thread allocated, goes back
+   to its own arena through my_free. */
+
+// Largest request served from the thread cache
+#define MY_TCACHE_MAX_SIZE 256
+#define MY_TCACHE_CLASSES 16
+
+// Size class of a request of 1..MY_TCACHE_MAX_SIZE bytes: 8-byte steps up to
+// 64, 16-byte steps up to 128, then 32-byte steps
+#define MY_CLASS_OF(n)                                   \
+    ((n) <= 64 ? ((n) + 7) / 8 - 1                       \
+     : (n) <= 128 ? 7 + ((n) - 64 + 15) / 16             \
+                  : 11 + ((n) - 128 + 31) / 32)
+
+// Payload size of a class
+#define MY_CLASS_SIZE(c) \
+    ((c) < 8 ? ((c) + 1) * 8 : (c) < 12 ? 64 + ((c) - 7) * 16 : 128 + ((c) - 11) * 32)
+
+// Class of every size in 8-byte words, filled in by the compiler. A row
+// covers words w+1 to w+4.
+#define MY_CLASS_ROW(w) \
+    MY_CLASS_OF((w) * 8 + 8), MY_CLASS_OF((w) * 8 + 16), MY_CLASS_OF((w) * 8 + 24), MY_CLASS_OF((w) * 8 + 32)
+static const unsigned char my_size_classes[MY_TCACHE_MAX_SIZE / 8 + 1] = {
+    0, MY_CLASS_ROW(0), MY_CLASS_ROW(4), MY_CLASS_ROW(8), MY_CLASS_ROW(12),
+    MY_CLASS_ROW(16), MY_CLASS_ROW(20), MY_CLASS_ROW(24), MY_CLASS_ROW(28),
+};
+
+// Constant sizes resolve their class at compile time, others use the table
+#define MY_SIZE_CLASS(n) \
+    (__builtin_constant_p(n) ? MY_CLASS_OF(n) : my_size_classes[((n) + 7) >> 3])
+
+typedef struct MyThreadCache MyThreadCache;
+
+struct MyThreadCache {
+    void *head[MY_TCACHE_CLASSES];
+    unsigned count[MY_TCACHE_CLASSES];
+    // Blocks a list may hold; 0 until the cache is enabled
+    unsigned limit;
+    // Links in the list of enabled caches, guarded by the heap lock
+    MyThreadCache *next;
+    MyThreadCache *prev;
+};
+
+extern __thread MyThreadCache my_tcache __attribute__((tls_model("initial-exec")));
+
+#define MY_TCACHE_STAMP ((Block *)&my_tcache)
+
+// Out-of-line halves of the fast path: refill the class of `size` and return
+// one block from it, or make room in a full list and cache `p`
+void *my_tcache_refill(size_t size);
+void my_tcache_flush(void *p, unsigned cls);
+
+#ifdef MYMALLOC_INLINE
+
+static inline void *my_malloc_fast(size_t size) {
+    if (size - 1 < MY_TCACHE_MAX_SIZE) {
+        unsigned cls = MY_SIZE_CLASS(size);
+        void *p = my_tcache.head[cls];
+        if (__builtin_expect(p != NULL, 1)) {
+            my_tcache.head[cls] = *(void **)p;
+            my_tcache.count[cls]--;
+            return p;
+        }
+        return my_tcache_refill(size);
+    }
+    return my_malloc(size);
+}
+
+static inline void my_free_fast(void *p) {
+    if (p == NULL) return;
+    Block *block = (Block *)((char *)p - sizeof(Block));
+    size_t size = block->size;
+    size_t payload = (size & SIZE_MASK) - sizeof(Block) - sizeof(size_t);
+    if (!(size & MMAPED_FLAG) && payload <= MY_TCACHE_MAX_SIZE && block->prev == MY_TCACHE_STAMP) {
+        // Largest class the block can serve
+        unsigned cls = my_size_classes[payload >> 3];
+        if (MY_CLASS_SIZE(cls) != payload) cls--;
+        if (__builtin_expect(my_tcache.count[cls] < my_tcache.limit, 1)) {
+            *(void **)p = my_tcache.head[cls];
+            my_tcache.head[cls] = p;
+            my_tcache.count[cls]++;
+            return;
+        }
+        my_tcache_flush(p, cls);
+        return;
+    }
+    my_free(p);
+}
+
+// Route plain calls through the fast path. `(my_malloc)(n)` still reaches the
+// library directly.
+#define my_malloc(size) my_malloc_fast(size)
+#define my_free(p) my_free_fast(p)
+
+#endif
+
+/* Collector support, used by the garbage collector in mygc.c. A segment is
+   the blocks of one arena up to its top, or one directly mapped block. Blocks
+   held in every thread's enabled cache look allocated too. The walks must
+   happen between my_heap_lock and my_heap_unlock. */
+
+typedef struct {
+    Block *first;
+    char *end;
+    bool mapped;
+} MyHeapSegment;
+
+void my_heap_lock(void);
+void my_heap_unlock(void);
+size_t my_heap_segments(MyHeapSegment *out, size_t max);
+size_t my_thread_caches(MyThreadCache **out, size_t max);
+int my_block_is_live(Block *block);
+
+// Called with the heap lock held for the payload of every block freed through
+// the library while it is set. Blocks the inline thread cache keeps are not
+// freed until it drains them.
+typedef void (*MyFreeHook)(void *p);
+void my_heap_set_free_hook(MyFreeHook hook);
 
 /* Helper functions you are required to implement for internal testing. */
 int is_free(Block *block);
@@ -52,5 +257,7 @@ Block *get_prev_block(Block *block);
 
 Block *ptr_to_block(void *ptr);
 size_t get_peak_memory_usage();
+size_t get_heap_size();
+size_t get_heap_reserved_size();
 
 #endif
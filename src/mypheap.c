@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include "mypheap.h"
+#include "mymalloc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Persistent heap allocator.
+ *
+ * The mapping starts with a header holding the segregated free lists, the
+ * root and a process-shared lock. Blocks follow between two fenceposts. Each
+ * block has its size and flags in a word at both ends, so its neighbours are
+ * found without pointers, and a free block keeps the offsets of its list
+ * neighbours in its first two payload words. Nothing in the mapping depends
+ * on the address it is mapped at.
+ *
+ * Each process holds a shared flock on the file while it has the heap open.
+ * An opener that can take the lock exclusively is alone: it formats an empty
+ * file, and resets the heap lock of an existing one, which a process that
+ * died might still hold.
+ */
+
+#define PHEAP_MAGIC 0x005041454850594Dull // "MYPHEAP"
+#define PHEAP_VERSION 1
+// Free lists: 32-byte steps below 1 KB, then one per power of two
+#define PHEAP_LISTS 48
+// Size word at each end of a block
+#define TAG_SIZE sizeof(uint64_t)
+// Smallest block: both tags and room for the two list links
+#define MIN_BLOCK (2 * TAG_SIZE + 2 * sizeof(uint64_t))
+// Start fencepost: a block made of its two tags
+#define FENCEPOST_SIZE (2 * TAG_SIZE)
+
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t size;
+    // Offset of the root object, or 0
+    uint64_t root;
+    // Payload bytes allocated
+    uint64_t usage;
+    // Offset of the first block on each free list, or 0
+    uint64_t lists[PHEAP_LISTS];
+    pthread_mutex_t lock;
+} PHeapHeader;
+
+// Offset of the start fencepost
+#define FIRST_FENCEPOST ((sizeof(PHeapHeader) + 15) & ~(size_t)15)
+
+static PHeapHeader *header_of(MyPHeap *heap) {
+    return (PHeapHeader *)heap->base;
+}
+
+static uint64_t *word_at(MyPHeap *heap, uint64_t offset) {
+    return (uint64_t *)(heap->base + offset);
+}
+
+static size_t size_at(MyPHeap *heap, uint64_t block) {
+    return *word_at(heap, block) & SIZE_MASK;
+}
+
+// Write both tags of a block
+static void set_tags(MyPHeap *heap, uint64_t block, size_t size, uint64_t flags) {
+    *word_at(heap, block) = size | flags;
+    *word_at(heap, block + size - TAG_SIZE) = size | flags;
+}
+
+static size_t list_index(size_t size) {
+    if (size < 1024) return size / 32;
+    size_t index = 32 + (63 - __builtin_clzll(size)) - 10;
+    return index < PHEAP_LISTS ? index : PHEAP_LISTS - 1;
+}
+
+// List links of a free block: next, then prev
+static uint64_t *links_of(MyPHeap *heap, uint64_t block) {
+    return word_at(heap, block + TAG_SIZE);
+}
+
+static void list_push(MyPHeap *heap, uint64_t block) {
+    uint64_t *head = &header_of(heap)->lists[list_index(size_at(heap, block))];
+    uint64_t *links = links_of(heap, block);
+    links[0] = *head;
+    links[1] = 0;
+    if (*head != 0) links_of(heap, *head)[1] = block;
+    *head = block;
+}
+
+static void list_unlink(MyPHeap *heap, uint64_t block) {
+    uint64_t *links = links_of(heap, block);
+    if (links[1] != 0) {
+        links_of(heap, links[1])[0] = links[0];
+    } else {
+        header_of(heap)->lists[list_index(size_at(heap, block))] = links[0];
+    }
+    if (links[0] != 0) links_of(heap, links[0])[1] = links[1];
+}
+
+// Whether `block`, which starts before the end fencepost, has matching tags
+// and ends inside the heap
+static bool tags_match(MyPHeap *heap, uint64_t block) {
+    uint64_t tag = *word_at(heap, block);
+    size_t size = tag & SIZE_MASK;
+    return size >= MIN_BLOCK && size % kAlignment == 0 && size <= heap->size - TAG_SIZE - block &&
+           *word_at(heap, block + size - TAG_SIZE) == tag;
+}
+
+// Rebuild the free lists, the footers and the usage from the block headers,
+// after a process died holding the lock. Every update writes the header that
+// covers its blocks before their footers, so the headers alone always tile the
+// heap: a split cut short leaves one larger free block, and an interrupted
+// free leaves free neighbours that are merged here. Returns false, changing
+// nothing, if the headers do not lead from one fencepost to the other.
+static bool recover_heap(MyPHeap *heap) {
+    uint64_t first = FIRST_FENCEPOST + FENCEPOST_SIZE;
+    uint64_t end = heap->size - TAG_SIZE;
+    if (*word_at(heap, end) != (TAG_SIZE | ALLOCATED_FLAG | FENCEPOST_FLAG)) return false;
+    for (uint64_t block = first; block != end; block += size_at(heap, block)) {
+        size_t size = size_at(heap, block);
+        if (size < MIN_BLOCK || size % kAlignment != 0 || size > end - block) return false;
+    }
+
+    PHeapHeader *header = header_of(heap);
+    memset(header->lists, 0, sizeof(header->lists));
+    header->usage = 0;
+    uint64_t block = first;
+    while (block != end) {
+        size_t size = size_at(heap, block);
+        if (*word_at(heap, block) & ALLOCATED_FLAG) {
+            set_tags(heap, block, size, ALLOCATED_FLAG);
+            header->usage += size - 2 * TAG_SIZE;
+        } else {
+            while (block + size != end && !(*word_at(heap, block + size) & ALLOCATED_FLAG)) {
+                size += size_at(heap, block + size);
+            }
+            set_tags(heap, block, size, 0);
+            list_push(heap, block);
+        }
+        block += size;
+    }
+    return true;
+}
+
+// Take the heap lock. If its owner died, perhaps in the middle of an update,
+// the heap is rebuilt from its tags first; when that fails the lock is left
+// unrecoverable and this and every later call fails.
+static bool lock_heap(MyPHeap *heap) {
+    pthread_mutex_t *lock = &header_of(heap)->lock;
+    int err = pthread_mutex_lock(lock);
+    if (err == EOWNERDEAD) {
+        if (!recover_heap(heap)) {
+            pthread_mutex_unlock(lock);
+            return false;
+        }
+        pthread_mutex_consistent(lock);
+    } else if (err != 0) {
+        return false;
+    }
+    return true;
+}
+
+static void unlock_heap(MyPHeap *heap) {
+    pthread_mutex_unlock(&header_of(heap)->lock);
+}
+
+static void init_lock(PHeapHeader *header) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Lay out an empty heap: one free block between the fenceposts. The magic is
+// written last, so a file left half formatted is never taken for a heap.
+static void format_heap(MyPHeap *heap) {
+    PHeapHeader *header = header_of(heap);
+    memset(header, 0, sizeof(PHeapHeader));
+    header->version = PHEAP_VERSION;
+    header->size = heap->size;
+    set_tags(heap, FIRST_FENCEPOST, FENCEPOST_SIZE, ALLOCATED_FLAG | FENCEPOST_FLAG);
+    uint64_t first = FIRST_FENCEPOST + FENCEPOST_SIZE;
+    uint64_t end = heap->size - TAG_SIZE;
+    *word_at(heap, end) = TAG_SIZE | ALLOCATED_FLAG | FENCEPOST_FLAG;
+    set_tags(heap, first, end - first, 0);
+    list_push(heap, first);
+    __atomic_store_n(&header->magic, PHEAP_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Map the heap in `fd`, formatting it if the file is empty. Takes ownership
+// of `fd` on success.
+static MyPHeap *attach(int fd, size_t size, void *base) {
+    bool alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!alone && flock(fd, LOCK_SH) != 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) goto fail;
+    // Only an opener that is alone can find the file empty: a creator holds
+    // the lock exclusively until the heap is formatted
+    bool format = st.st_size == 0;
+    if (format) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size = (size + page - 1) & ~(page - 1);
+        if (size < page) size = page;
+        if (!alone || ftruncate(fd, size) != 0) goto fail;
+    } else {
+        size = st.st_size;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    if (base != NULL) flags |= MAP_FIXED_NOREPLACE;
+#endif
+    char *mem = mmap(base, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (mem == MAP_FAILED) goto fail;
+    MyPHeap *heap = my_malloc(sizeof(MyPHeap));
+    if ((base != NULL && mem != base) || heap == NULL) {
+        munmap(mem, size);
+        my_free(heap);
+        goto fail;
+    }
+    heap->base = mem;
+    heap->size = size;
+    heap->fd = fd;
+
+    PHeapHeader *header = header_of(heap);
+    if (format) {
+        format_heap(heap);
+    } else if (size < FIRST_FENCEPOST + FENCEPOST_SIZE + MIN_BLOCK + TAG_SIZE ||
+               header->magic != PHEAP_MAGIC || header->version != PHEAP_VERSION ||
+               header->size != size) {
+        munmap(mem, size);
+        my_free(heap);
+        goto fail;
+    }
+    if (alone) {
+        init_lock(header);
+        flock(fd, LOCK_SH);
+    }
+    return heap;
+
+fail:
+    flock(fd, LOCK_UN);
+    return NULL;
+}
+
+/* API */
+
+// Open the heap in the file at `path`, creating a heap of `size` bytes if the
+// file is new or empty; an existing heap keeps its own size. With a NULL path
+// the heap lives in a new memfd, which forked children share. With a NULL
+// `base` the heap goes wherever the kernel puts it, otherwise exactly at
+// `base` or not at all. Returns NULL if the file is not a heap.
+MyPHeap *my_pheap_open(const char *path, size_t size, void *base) {
+    int fd;
+    if (path == NULL) {
+#ifdef __linux__
+        fd = memfd_create("mypheap", MFD_CLOEXEC);
+#else
+        errno = ENOTSUP;
+        fd = -1;
+#endif
+    } else {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) return NULL;
+    MyPHeap *heap = attach(fd, size, base);
+    if (heap == NULL) close(fd);
+    return heap;
+}
+
+// Open the heap in a file another process passed on, such as a memfd. `fd`
+// is not consumed.
+MyPHeap *my_pheap_open_fd(int fd, size_t size, void *base) {
+#ifdef __linux__
+    // A file description of our own, so our flock is not shared with the
+    // process that handed over `fd`
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int own = open(path, O_RDWR | O_CLOEXEC);
+#else
+    int own = dup(fd);
+#endif
+    if (own < 0) return NULL;
+    MyPHeap *heap = attach(own, size, base);
+    if (heap == NULL) close(own);
+    return heap;
+}
+
+// Write the heap back to its file
+int my_pheap_sync(MyPHeap *heap) {
+    return msync(heap->base, heap->size, MS_SYNC);
+}
+
+// Unmap the heap. Its objects stay in the file for the next open.
+void my_pheap_close(MyPHeap *heap) {
+    if (heap == NULL) return;
+    munmap(heap->base, heap->size);
+    close(heap->fd);
+    my_free(heap);
+}
+
+// Allocate `size` bytes in the heap, first fit from the smallest list that
+// can hold the block. Returns NULL once the heap is full; it never grows.
+void *my_pheap_malloc(MyPHeap *heap, size_t size) {
+    if (size == 0 || size > heap->size) return NULL;
+    size_t block_size = (size + 2 * TAG_SIZE + kAlignment - 1) & ~(kAlignment - 1);
+    if (block_size < MIN_BLOCK) block_size = MIN_BLOCK;
+
+    if (!lock_heap(heap)) return NULL;
+    PHeapHeader *header = header_of(heap);
+    uint64_t block = 0;
+    for (size_t i = list_index(block_size); i < PHEAP_LISTS && block == 0; i++) {
+        for (uint64_t b = header->lists[i]; b != 0; b = links_of(heap, b)[0]) {
+            if (size_at(heap, b) >= block_size) {
+                block = b;
+                break;
+            }
+        }
+    }
+    if (block != 0) {
+        list_unlink(heap, block);
+        size_t total = size_at(heap, block);
+        if (total - block_size >= MIN_BLOCK) {
+            set_tags(heap, block + block_size, total - block_size, 0);
+            list_push(heap, block + block_size);
+            total = block_size;
+        }
+        set_tags(heap, block, total, ALLOCATED_FLAG);
+        header->usage += total - 2 * TAG_SIZE;
+    }
+    unlock_heap(heap);
+    return block == 0 ? NULL : heap->base + block + TAG_SIZE;
+}
+
+// Free an object, coalescing it with free neighbours. Pointers that are not
+// allocated objects of this heap are ignored: the block must lie inside the
+// heap with a footer that matches its header.
+void my_pheap_free(MyPHeap *heap, void *p) {
+    if (p == NULL) return;
+    uint64_t block = (char *)p - heap->base - TAG_SIZE;
+    if ((char *)p < heap->base || block < FIRST_FENCEPOST + FENCEPOST_SIZE ||
+        block >= heap->size - TAG_SIZE || block % kAlignment != 0) {
+        return;
+    }
+
+    if (!lock_heap(heap)) return;
+    uint64_t tag = *word_at(heap, block);
+    if ((tag & (ALLOCATED_FLAG | FENCEPOST_FLAG)) != ALLOCATED_FLAG || !tags_match(heap, block)) {
+        unlock_heap(heap);
+        return;
+    }
+    size_t size = tag & SIZE_MASK;
+    header_of(heap)->usage -= size - 2 * TAG_SIZE;
+
+    // Fenceposts count as allocated, so neither end is ever merged
+    uint64_t next = block + size;
+    if (!(*word_at(heap, next) & ALLOCATED_FLAG)) {
+        list_unlink(heap, next);
+        size += size_at(heap, next);
+    }
+    uint64_t prev_tag = *word_at(heap, block - TAG_SIZE);
+    if (!(prev_tag & ALLOCATED_FLAG)) {
+        block -= prev_tag & SIZE_MASK;
+        list_unlink(heap, block);
+        size += prev_tag & SIZE_MASK;
+    }
+    set_tags(heap, block, size, 0);
+    list_push(heap, block);
+    unlock_heap(heap);
+}
+
+// The object a later open starts from, or NULL
+void *my_pheap_root(MyPHeap *heap) {
+    return my_pheap_ptr(heap, __atomic_load_n(&header_of(heap)->root, __ATOMIC_ACQUIRE));
+}
+
+void my_pheap_set_root(MyPHeap *heap, void *p) {
+    __atomic_store_n(&header_of(heap)->root, my_pheap_offset(heap, p), __ATOMIC_RELEASE);
+}
+
+// Payload bytes allocated in the heap, by every process using it
+size_t my_pheap_usage(MyPHeap *heap) {
+    return __atomic_load_n(&header_of(heap)->usage, __ATOMIC_RELAXED);
+}
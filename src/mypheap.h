@@ -0,0 +1,42 @@
+#ifndef MYPHEAP_HEADER
+#define MYPHEAP_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Persistent heaps. A heap lives in one shared mapping of a file or memfd,
+   and everything it needs (the boundary tags, free lists and a root object)
+   is kept inside the mapping as offsets from its start. A restarted process
+   can open the file at any address and find its objects as it left them, and
+   several processes can use one heap at once. Objects must refer to each
+   other by offset as well; my_pheap_offset and my_pheap_ptr convert. */
+
+// Handle of an open heap, private to the process that opened it
+typedef struct {
+    char *base;
+    size_t size;
+    int fd;
+} MyPHeap;
+
+MyPHeap *my_pheap_open(const char *path, size_t size, void *base);
+MyPHeap *my_pheap_open_fd(int fd, size_t size, void *base);
+int my_pheap_sync(MyPHeap *heap);
+void my_pheap_close(MyPHeap *heap);
+
+void *my_pheap_malloc(MyPHeap *heap, size_t size);
+void my_pheap_free(MyPHeap *heap, void *p);
+void *my_pheap_root(MyPHeap *heap);
+void my_pheap_set_root(MyPHeap *heap, void *p);
+size_t my_pheap_usage(MyPHeap *heap);
+
+// Offset of an object in the heap, 0 for NULL; it means the same object in
+// every process that has the heap open
+static inline size_t my_pheap_offset(MyPHeap *heap, const void *p) {
+    return p == NULL ? 0 : (size_t)((const char *)p - heap->base);
+}
+
+static inline void *my_pheap_ptr(MyPHeap *heap, size_t offset) {
+    return offset == 0 ? NULL : heap->base + offset;
+}
+
+#endif
@@ -30,6 +30,9 @@ def setup_parser(parser: ArgumentParser):
     parser.add_argument("-t", "--test", help="test name to run", type=str)
     parser.add_argument("--release", help="build in release mode", action="store_true")
     parser.add_argument("--log", help="build with logging", action="store_true")
+    parser.add_argument("--hardened", help="build with heap hardening checks", action="store_true")
+    parser.add_argument("--guard-pages", help="build with guard pages after large blocks", action="store_true")
+    parser.add_argument("--hugepages", help="build with huge page backed arenas", action="store_true")
     parser.add_argument("-m", "--malloc", type=str, help="allocator name, default to \"mymalloc\"")
 
 
@@ -142,6 +145,12 @@ def main():
         build_cmd += "RELEASE=1 "
     if args.log:
         build_cmd += "LOG=1 "
+    if args.hardened:
+        build_cmd += "HARDENED=1 "
+    if args.guard_pages:
+        build_cmd += "GUARD_PAGES=1 "
+    if args.hugepages:
+        build_cmd += "HUGEPAGES=1 "
 
     output, exit_code = make(build_cmd, script_path)
     check_make(build_cmd, output, exit_code)
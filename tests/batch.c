@@ -0,0 +1,58 @@
+#include "testing.h"
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * This test allocates and frees nodes in batches with `my_malloc_batch` and
+ * `my_free_batch`, checking every node is distinct, aligned and writable and
+ * that freeing the batch returns all of its memory.
+ *
+ * Reason(s) you might be failing this test:
+ * - Blocks carved from one region overlap or are not marked allocated.
+ * - `my_free_batch` does not handle pointers given out of address order.
+ */
+
+#define NODE_SIZE 48
+#define NODES 300
+
+int main(void) {
+  void *nodes[NODES];
+  for (int round = 0; round < 10; round++) {
+    size_t got = my_malloc_batch(NODE_SIZE, NODES, nodes);
+    if (got != NODES) {
+      fprintf(stderr, "my_malloc_batch returned %zu of %d nodes\n", got, NODES);
+      return 1;
+    }
+    for (int i = 0; i < NODES; i++) {
+      assert(((uintptr_t)nodes[i] & (sizeof(size_t) - 1)) == 0);
+      memset(nodes[i], i & 0xFF, NODE_SIZE);
+    }
+    for (int i = 0; i < NODES; i++) {
+      unsigned char *bytes = nodes[i];
+      for (int j = 0; j < NODE_SIZE; j++) {
+        if (bytes[j] != (i & 0xFF)) {
+          fprintf(stderr, "node %d overlaps another node\n", i);
+          return 1;
+        }
+      }
+    }
+
+    // Free in a scrambled order, with a foreign NULL mixed in
+    for (int i = 0; i < NODES; i += 7) {
+      void *tmp = nodes[i];
+      nodes[i] = nodes[NODES - 1 - i];
+      nodes[NODES - 1 - i] = tmp;
+    }
+    nodes[NODES / 2] = NULL;
+    my_free_batch(nodes, NODES);
+  }
+
+  // Everything but the one node replaced by NULL each round has been returned
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (stats.current_usage > 10 * 2 * NODE_SIZE) {
+    fprintf(stderr, "%zu bytes still in use after batch frees\n", stats.current_usage);
+    return 1;
+  }
+  return 0;
+}
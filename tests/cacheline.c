@@ -0,0 +1,135 @@
+#include "testing.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * This test checks that small blocks of different threads never share a cache
+ * line. Several threads allocate small blocks at the same time, yielding to
+ * each other between allocations, and some of the blocks are freed by another
+ * thread. It then interleaves plain blocks with blocks allocated with
+ * MY_HINT_CACHELINE, which must start on a line and share none of their lines
+ * with any other block. A cache-line block carved from the top must give what
+ * it does not use back to the top.
+ *
+ * Reason(s) you might be failing this test:
+ * - Threads' small blocks are carved from the same arena.
+ * - A cache-line block is not padded to the end of its last line.
+ * - The remainder of a cache-line block is split off as a free block even when
+ *   it borders the top.
+ */
+
+#define LINE 64
+#define THREADS 4
+#define PER_THREAD 64
+#define PAIRS 100
+
+static void *blocks[THREADS][PER_THREAD];
+static pthread_barrier_t barrier;
+
+static uintptr_t first_line(void *p) {
+  return (uintptr_t)p / LINE;
+}
+
+static uintptr_t last_line(void *p) {
+  return ((uintptr_t)p + my_malloc_usable_size(p) - 1) / LINE;
+}
+
+static int share_line(void *a, void *b) {
+  return first_line(a) <= last_line(b) && first_line(b) <= last_line(a);
+}
+
+static void *allocate_blocks(void *arg) {
+  intptr_t t = (intptr_t)arg;
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < PER_THREAD; i++) {
+    blocks[t][i] = mallocing(8 + (i * 24 + t * 8) % 120);
+    memset(blocks[t][i], (int)t, 8);
+    sched_yield();
+  }
+  // Free the previous thread's odd blocks; they go back to that thread
+  pthread_barrier_wait(&barrier);
+  for (int i = 1; i < PER_THREAD; i += 2) {
+    freeing(blocks[(t + THREADS - 1) % THREADS][i]);
+  }
+  pthread_barrier_wait(&barrier);
+  for (int i = 1; i < PER_THREAD; i += 2) {
+    blocks[t][i] = mallocing(8 + (i * 24 + t * 8) % 120);
+    sched_yield();
+  }
+  return NULL;
+}
+
+int main(void) {
+  // A block carved from the top gives the rest back to it, so the block after
+  // it is the top rather than a free remainder
+  void *carved = my_malloc_hint(40, MY_HINT_CACHELINE);
+  CHECK_NULL(carved);
+  Block *rest = get_next_block(ptr_to_block(carved));
+  if (rest != NULL && get_next_block(rest) != NULL) {
+    fprintf(stderr, "a cache-line block left a free block beside the top\n");
+    return 1;
+  }
+  freeing(carved);
+
+  pthread_t threads[THREADS];
+  pthread_barrier_init(&barrier, NULL, THREADS);
+  for (intptr_t t = 0; t < THREADS; t++) {
+    pthread_create(&threads[t], NULL, allocate_blocks, (void *)t);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  for (int a = 0; a < THREADS; a++) {
+    for (int b = a + 1; b < THREADS; b++) {
+      for (int i = 0; i < PER_THREAD; i++) {
+        for (int j = 0; j < PER_THREAD; j++) {
+          if (share_line(blocks[a][i], blocks[b][j])) {
+            fprintf(stderr, "blocks of threads %d and %d share a cache line\n", a, b);
+            return 1;
+          }
+        }
+      }
+    }
+  }
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i < PER_THREAD; i++) {
+      freeing(blocks[t][i]);
+    }
+  }
+
+  void *plain[PAIRS], *lines[PAIRS];
+  for (int i = 0; i < PAIRS; i++) {
+    plain[i] = mallocing(8 + i % 50);
+    lines[i] = my_malloc_hint(1 + (i * 7) % 200, MY_HINT_CACHELINE);
+    CHECK_NULL(lines[i]);
+    if ((uintptr_t)lines[i] % LINE != 0) {
+      fprintf(stderr, "a cache-line block is not aligned: %p\n", lines[i]);
+      return 1;
+    }
+  }
+  for (int i = 0; i < PAIRS; i++) {
+    for (int j = 0; j < PAIRS; j++) {
+      if (share_line(lines[i], plain[j]) || (i != j && share_line(lines[i], lines[j]))) {
+        fprintf(stderr, "a cache-line block shares its lines\n");
+        return 1;
+      }
+    }
+  }
+  for (int i = 0; i < PAIRS; i++) {
+    freeing(plain[i]);
+    freeing(lines[i]);
+  }
+
+#ifndef MYMALLOC_INLINE
+  // Blocks kept in the main thread's inline cache still count as allocated
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (stats.current_usage != 0) {
+    fprintf(stderr, "%zu bytes still in use\n", stats.current_usage);
+    return 1;
+  }
+#endif
+  return 0;
+}
@@ -0,0 +1,41 @@
+#define MYMALLOC_INLINE
+#define main run_cacheline
+#include "cacheline.c"
+#undef main
+
+/**
+ * This test runs the cache-line test through the inline fast path in
+ * mymalloc.h, where blocks freed by another thread could otherwise land in
+ * the freeing thread's cache and be handed out to it. It then frees blocks a
+ * refill handed out through the library and allocates one again the same
+ * way, and the inline free must not cache that block.
+ *
+ * Reason(s) you might be failing this test:
+ * - The inline free caches blocks its own cache did not hand out.
+ * - A block freed through the library keeps its cache's stamp.
+ */
+
+#define STAMPED 16
+#define STAMPED_SIZE 32
+
+int main(void) {
+  // The blocks are carved from the top, and go back to it when freed
+  void *stamped[STAMPED];
+  for (int i = 0; i < STAMPED; i++) {
+    stamped[i] = mallocing(STAMPED_SIZE);
+  }
+  // From the last, so each block merges straight into the top
+  for (int i = STAMPED - 1; i >= 0; i--) {
+    (my_free)(stamped[i]);
+  }
+  void *p = (my_malloc)(STAMPED_SIZE);
+  CHECK_NULL(p);
+  unsigned cls = MY_CLASS_OF(STAMPED_SIZE);
+  unsigned cached = my_tcache.count[cls];
+  freeing(p);
+  if (my_tcache.count[cls] != cached) {
+    fprintf(stderr, "a block from the library was cached on free\n");
+    return 1;
+  }
+  return run_cacheline();
+}
@@ -0,0 +1,87 @@
+#define MYMALLOC_INLINE
+#include "testing.h"
+#include <pthread.h>
+#include <string.h>
+
+/**
+ * This test allocates and frees through the inline fast path in mymalloc.h
+ * (MYMALLOC_INLINE), with constant and variable sizes, from two threads.
+ *
+ * Reason(s) you might be failing this test:
+ * - The compile-time size-class table disagrees with MY_CLASS_OF.
+ * - A freed block is cached in a class bigger than its payload.
+ * - A thread's cached blocks are not returned to the heap when it exits.
+ */
+
+_Static_assert(MY_CLASS_OF(1) == 0 && MY_CLASS_OF(64) == 7 && MY_CLASS_OF(65) == 8 &&
+                   MY_CLASS_OF(256) == MY_TCACHE_CLASSES - 1,
+               "size classes");
+
+#define SLOTS 300
+
+static void *churn(void *arg) {
+  static __thread unsigned char *slots[SLOTS];
+  static __thread size_t sizes[SLOTS];
+  unsigned seed = (unsigned)(size_t)arg;
+  for (int i = 0; i < 50000; i++) {
+    int slot = rand_r(&seed) % SLOTS;
+    if (slots[slot] != NULL) {
+      for (size_t j = 0; j < sizes[slot]; j++) {
+        if (slots[slot][j] != (unsigned char)slot) {
+          fprintf(stderr, "slot %d was overwritten\n", slot);
+          exit(1);
+        }
+      }
+      my_free(slots[slot]);
+    }
+    sizes[slot] = 1 + rand_r(&seed) % (rand_r(&seed) % 16 == 0 ? 4000 : 300);
+    slots[slot] = my_malloc(sizes[slot]);
+    CHECK_NULL(slots[slot]);
+    memset(slots[slot], slot, sizes[slot]);
+  }
+  for (int i = 0; i < SLOTS; i++) {
+    my_free(slots[i]);
+  }
+  return NULL;
+}
+
+int main(void) {
+  for (size_t n = 1; n <= MY_TCACHE_MAX_SIZE; n++) {
+    unsigned cls = my_size_classes[(n + 7) >> 3];
+    if (cls != MY_CLASS_OF(n) || MY_CLASS_SIZE(cls) < n ||
+        (cls > 0 && MY_CLASS_SIZE(cls - 1) >= n)) {
+      fprintf(stderr, "size %zu is in the wrong class %u\n", n, cls);
+      return 1;
+    }
+  }
+
+  // Constant sizes take the compile-time class
+  void *a = my_malloc(24);
+  void *b = my_malloc(200);
+  CHECK_NULL(a);
+  CHECK_NULL(b);
+  memset(a, 1, 24);
+  memset(b, 2, 200);
+  my_free(a);
+  my_free(b);
+
+  MallocStats before;
+  my_malloc_stats(&before);
+  pthread_t threads[2];
+  for (size_t i = 0; i < 2; i++) {
+    pthread_create(&threads[i], NULL, churn, (void *)(i + 1));
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // The threads' caches went back to the heap when they exited
+  MallocStats after;
+  my_malloc_stats(&after);
+  if (after.current_usage != before.current_usage) {
+    fprintf(stderr, "%zu bytes still cached after the threads exited\n",
+            after.current_usage - before.current_usage);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include "testing.h"
+#include "../src/mygc.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * This test builds a large random object graph, drops most of it and runs the
+ * garbage collector. A forked child collects the same heap on one thread while
+ * the parent collects with several, and both must free the same number of
+ * blocks. Every node reachable from the roots, including one held only by an
+ * interior pointer, must survive intact, and about as many blocks as are
+ * unreachable must be freed.
+ *
+ * Reason(s) you might be failing this test:
+ * - Two threads both push a block they marked, or neither does.
+ * - Marking stops while another thread still has work to steal.
+ * - Interior pointers or pointers held in large blocks are not followed.
+ */
+
+#define NODES 60000
+#define EDGES 3
+#define ROOTS 8
+#define ARRAYS 4
+#define ARRAY_SLOTS (160 << 10) / sizeof(void *)
+// Node addresses are kept XORed with this, so the table is not a root
+#define MASK 0x5A5A5A5A5A5A5A5Aull
+
+typedef struct Node Node;
+struct Node {
+  Node *edges[EDGES];
+  uint32_t edge_ids[EDGES];
+  uint32_t id;
+  uint64_t check;
+};
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t next_random(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static uint64_t check_of(uint32_t id) {
+  return id * 0x9E3779B97F4A7C15ull;
+}
+
+static Node *node_at(uintptr_t *table, uint32_t id) {
+  return (Node *)(table[id] ^ MASK);
+}
+
+// Allocate the graph. Most nodes point at random other nodes; a few large
+// arrays hold pointers too and are scanned in pieces.
+__attribute__((noinline)) static void build(uintptr_t *table, void **roots, uint32_t *root_ids) {
+  for (uint32_t i = 0; i < NODES; i++) {
+    Node *node = mallocing(sizeof(Node) + (i % 7) * 16);
+    node->id = i;
+    node->check = check_of(i);
+    table[i] = (uintptr_t)node ^ MASK;
+  }
+  for (uint32_t i = 0; i < NODES; i++) {
+    Node *node = node_at(table, i);
+    for (int e = 0; e < EDGES; e++) {
+      // A quarter of the edges point at the next node, so live chains run deep
+      uint32_t to = next_random() % 4 == 0 ? i + 1 : next_random() % NODES;
+      if (to >= NODES || next_random() % 5 < 3) {
+        node->edges[e] = NULL;
+        node->edge_ids[e] = UINT32_MAX;
+      } else {
+        node->edges[e] = node_at(table, to);
+        node->edge_ids[e] = to;
+      }
+    }
+  }
+  for (int r = 0; r < ROOTS; r++) {
+    root_ids[r] = next_random() % NODES;
+    roots[r] = node_at(table, root_ids[r]);
+  }
+  // One root only points into the middle of its node
+  roots[0] = (char *)roots[0] + sizeof(void *);
+}
+
+// Overwrite the stack left behind by build, so stale pointers do not keep
+// garbage alive
+__attribute__((noinline)) static void clear_stack(void) {
+  char junk[64 << 10];
+  memset(junk, 0, sizeof(junk));
+  // The stores are otherwise dead and dropped by the optimizer
+  __asm__ volatile("" : : "r"(junk) : "memory");
+}
+
+// Mark the nodes reachable from `ids` in `live`, returning how many there are
+static size_t reachable(uintptr_t *table, const uint32_t *ids, size_t n, char *live) {
+  uint32_t *queue = malloc(NODES * sizeof(uint32_t));
+  size_t head = 0, tail = 0, count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!live[ids[i]]) {
+      live[ids[i]] = 1;
+      queue[tail++] = ids[i];
+    }
+  }
+  while (head < tail) {
+    Node *node = node_at(table, queue[head++]);
+    count++;
+    for (int e = 0; e < EDGES; e++) {
+      uint32_t to = node->edge_ids[e];
+      if (to != UINT32_MAX && !live[to]) {
+        live[to] = 1;
+        queue[tail++] = to;
+      }
+    }
+  }
+  free(queue);
+  return count;
+}
+
+int main(void) {
+  set_start_of_stack(__builtin_frame_address(0));
+
+  uintptr_t *table = malloc(NODES * sizeof(uintptr_t));
+  char *live = calloc(NODES, 1);
+  void *roots[ROOTS];
+  uint32_t root_ids[ROOTS + ARRAYS * 16];
+  build(table, roots, root_ids);
+
+  // Large arrays each hold a few more roots near their ends
+  size_t n_ids = ROOTS;
+  void **arrays[ARRAYS];
+  for (int a = 0; a < ARRAYS; a++) {
+    arrays[a] = mallocing(ARRAY_SLOTS * sizeof(void *));
+    memset(arrays[a], 0, ARRAY_SLOTS * sizeof(void *));
+    for (int k = 0; k < 16; k++) {
+      uint32_t id = next_random() % NODES;
+      arrays[a][ARRAY_SLOTS - 1 - k * 97] = node_at(table, id);
+      root_ids[n_ids++] = id;
+    }
+  }
+  size_t expected_live = reachable(table, root_ids, n_ids, live);
+  size_t expected_garbage = NODES - expected_live;
+  clear_stack();
+
+  int fds[2];
+  assert(pipe(fds) == 0);
+  pid_t pid = fork();
+  if (pid == 0) {
+    my_gc_set_threads(1);
+    size_t freed = my_gc();
+    assert(write(fds[1], &freed, sizeof(freed)) == sizeof(freed));
+    _exit(0);
+  }
+  size_t serial_freed = 0;
+  assert(read(fds[0], &serial_freed, sizeof(serial_freed)) == sizeof(serial_freed));
+  waitpid(pid, NULL, 0);
+
+  my_gc_set_threads(4);
+  size_t freed = my_gc();
+  if (freed != serial_freed) {
+    fprintf(stderr, "4 threads freed %zu blocks, 1 thread %zu\n", freed, serial_freed);
+    return 1;
+  }
+  // Stale words on the stack may keep a little garbage alive, never more
+  if (freed > expected_garbage || freed < expected_garbage - expected_garbage / 100) {
+    fprintf(stderr, "freed %zu blocks of %zu unreachable\n", freed, expected_garbage);
+    return 1;
+  }
+
+  // Reuse the freed memory, then check every reachable node is untouched
+  for (int i = 0; i < NODES / 2; i++) {
+    memset(mallocing(sizeof(Node)), 0xFF, sizeof(Node));
+  }
+  for (uint32_t i = 0; i < NODES; i++) {
+    if (!live[i]) continue;
+    Node *node = node_at(table, i);
+    if (node->id != i || node->check != check_of(i)) {
+      fprintf(stderr, "reachable node %u was freed\n", i);
+      return 1;
+    }
+  }
+
+  // Keep the roots alive up to here
+  for (int r = 0; r < ROOTS; r++) assert(roots[r] != NULL);
+  for (int a = 0; a < ARRAYS; a++) assert(arrays[a] != NULL);
+  free(table);
+  free(live);
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include "testing.h"
+#include "../src/mygc.h"
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * This test turns off stack scanning and keeps objects alive through
+ * registered roots only: a range of globals and a single pointer slot. With
+ * no stack to retain stale pointers, every collection must free exactly the
+ * objects that cannot be reached. Objects pointed at only from atomic
+ * buffers, small and large, must be freed, while a plain buffer keeps what it
+ * points at. Removing a root must release what it held. A block allocated
+ * where an atomic block was freed must be scanned.
+ *
+ * Reason(s) you might be failing this test:
+ * - Registered ranges or slots are not scanned, or are still scanned after
+ *   being removed.
+ * - The contents of atomic objects are scanned.
+ * - A freed atomic block is still skipped once its memory is reused, whether
+ *   the collector or my_free freed it.
+ */
+
+#define CELLS 1000
+#define GARBAGE 20000
+#define SLOTS 16
+#define LARGE_SLOTS ((64 << 10) / sizeof(void *))
+
+typedef struct Cell Cell;
+struct Cell {
+  Cell *next;
+  uint64_t value;
+};
+
+static void *globals[4];
+static Cell *slot;
+
+static Cell *make_list(int n, uint64_t base) {
+  Cell *head = NULL;
+  for (int i = n - 1; i >= 0; i--) {
+    Cell *cell = my_gc_alloc(sizeof(Cell));
+    CHECK_NULL(cell);
+    cell->next = head;
+    cell->value = base + i;
+    head = cell;
+  }
+  return head;
+}
+
+static int check_list(Cell *head, int n, uint64_t base) {
+  for (int i = 0; i < n; i++, head = head->next) {
+    if (head == NULL || head->value != base + i) return 0;
+  }
+  return head == NULL;
+}
+
+// Point the first SLOTS words of `buffer` at new cells
+static void fill(Cell **buffer, uint64_t base) {
+  for (int i = 0; i < SLOTS; i++) {
+    buffer[i] = make_list(1, base + i);
+  }
+}
+
+static int check_filled(Cell **buffer, uint64_t base) {
+  for (int i = 0; i < SLOTS; i++) {
+    if (!check_list(buffer[i], 1, base + i)) return 0;
+  }
+  return 1;
+}
+
+static int expect_freed(size_t expected, const char *what) {
+  size_t freed = my_gc();
+  if (freed != expected) {
+    fprintf(stderr, "%s: freed %zu objects, expected %zu\n", what, freed, expected);
+    return 0;
+  }
+  return 1;
+}
+
+int main(void) {
+  my_gc_set_threads(2);
+  my_gc_set_stack_scanning(false);
+  assert(my_gc_add_roots(globals, globals + 4) == 0);
+  assert(my_gc_add_root((void **)&slot) == 0);
+
+  globals[0] = make_list(CELLS, 0);
+  slot = make_list(CELLS, 1000000);
+  for (int i = 0; i < GARBAGE; i++) {
+    void *garbage = my_gc_alloc(sizeof(Cell) + (i % 4) * 8);
+    CHECK_NULL(garbage);
+  }
+  // Only the stack holds this list, and the stack is not scanned
+  make_list(CELLS, 2000000);
+
+  Cell **small = my_gc_alloc_atomic(SLOTS * sizeof(Cell *));
+  Cell **large = my_gc_alloc_atomic(LARGE_SLOTS * sizeof(Cell *));
+  Cell **plain = my_gc_alloc(SLOTS * sizeof(Cell *));
+  CHECK_NULL(small);
+  CHECK_NULL(large);
+  CHECK_NULL(plain);
+  fill(small, 3000000);
+  fill(large, 4000000);
+  fill(plain, 5000000);
+  globals[1] = small;
+  globals[2] = large;
+  globals[3] = plain;
+
+  if (!expect_freed(GARBAGE + CELLS + 2 * SLOTS, "registered roots")) return 1;
+  if (!check_list(globals[0], CELLS, 0) || !check_list(slot, CELLS, 1000000) ||
+      !check_filled(plain, 5000000)) {
+    fprintf(stderr, "an object reachable from a registered root was lost\n");
+    return 1;
+  }
+
+  // Drop the slot and the large atomic buffer
+  my_gc_remove_root((void **)&slot);
+  globals[2] = NULL;
+  if (!expect_freed(CELLS + 1, "removed slot")) return 1;
+
+  // A plain block in the atomic buffer's old place must be scanned
+  Cell **reused = my_gc_alloc(LARGE_SLOTS * sizeof(Cell *));
+  CHECK_NULL(reused);
+  fill(reused, 6000000);
+  globals[2] = reused;
+  if (!expect_freed(0, "reused atomic block")) return 1;
+  if (!check_filled(reused, 6000000)) {
+    fprintf(stderr, "a cell held by a reused block was freed\n");
+    return 1;
+  }
+
+  // So must one allocated where an atomic block was explicitly freed
+  Cell **dropped = my_gc_alloc_atomic(LARGE_SLOTS * sizeof(Cell *));
+  CHECK_NULL(dropped);
+  my_free(dropped);
+  Cell **replaced = my_gc_alloc(LARGE_SLOTS * sizeof(Cell *));
+  CHECK_NULL(replaced);
+  fill(replaced, 7000000);
+  reused[SLOTS] = (Cell *)replaced;
+  if (!expect_freed(0, "atomic block freed with my_free")) return 1;
+  if (!check_filled(replaced, 7000000)) {
+    fprintf(stderr, "a cell held by a block in a freed atomic block's place was freed\n");
+    return 1;
+  }
+
+  // Without the range nothing is reachable
+  my_gc_remove_roots(globals, globals + 4);
+  if (!expect_freed(CELLS + 4 + 3 * SLOTS, "removed range")) return 1;
+  return 0;
+}
@@ -0,0 +1,79 @@
+#define MYMALLOC_INLINE
+#include "testing.h"
+#include "../src/mygc.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * This test fills another thread's cache through the inline fast path, then
+ * collects from the main thread with stack scanning off. Nothing is reachable,
+ * but the other thread's cached blocks still belong to the allocator, so the
+ * collection must free none of them. The blocks the main thread allocates
+ * next must not be the ones the other thread then takes from its cache.
+ *
+ * Reason(s) you might be failing this test:
+ * - Only the collecting thread's cache is scanned as a root.
+ * - An exiting thread's cache is not taken off the list of caches.
+ */
+
+#define SIZE 24
+#define COUNT 16
+
+static void *taken[COUNT];
+static pthread_barrier_t barrier;
+
+static void *fill_cache(void *arg) {
+  // One refill caches a batch, and the freed block joins it
+  my_free(mallocing(SIZE));
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < COUNT; i++) {
+    taken[i] = mallocing(SIZE);
+  }
+  pthread_barrier_wait(&barrier);
+  freeing_loop(taken, COUNT);
+  return NULL;
+}
+
+int main(void) {
+  my_gc_set_stack_scanning(false);
+  pthread_barrier_init(&barrier, NULL, 2);
+  pthread_t thread;
+  pthread_create(&thread, NULL, fill_cache, NULL);
+
+  pthread_barrier_wait(&barrier);
+  size_t freed = my_gc();
+  if (freed != 0) {
+    fprintf(stderr, "the collection freed %zu blocks from another thread's cache\n", freed);
+    return 1;
+  }
+  void *mine[COUNT];
+  for (int i = 0; i < COUNT; i++) {
+    mine[i] = (my_malloc)(SIZE);
+    CHECK_NULL(mine[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < COUNT; i++) {
+    for (int j = 0; j < COUNT; j++) {
+      if (mine[i] == taken[j]) {
+        fprintf(stderr, "%p was handed out twice\n", mine[i]);
+        return 1;
+      }
+    }
+  }
+  pthread_join(thread, NULL);
+  for (int i = 0; i < COUNT; i++) {
+    (my_free)(mine[i]);
+  }
+
+  // The exited thread's cache is gone, so collecting again is safe
+  my_gc();
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (stats.current_usage != 0) {
+    fprintf(stderr, "%zu bytes still in use\n", stats.current_usage);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include "testing.h"
+#include <string.h>
+
+/**
+ * This test sets soft and hard limits with `my_malloc_set_limits` and keeps a
+ * cache of 1 KB objects that a pressure callback trims. Crossing the soft
+ * limit must call the callback once and let the allocation through. A request
+ * over the hard limit must call the callback, then succeed if the callback
+ * freed enough, and fail otherwise, without leaving pressure pending. A
+ * directly mapped block must count all of its pages against the limit.
+ *
+ * Reason(s) you might be failing this test:
+ * - The callbacks run with the heap lock held, so freeing from them deadlocks.
+ * - A refused allocation is not retried after the callbacks return.
+ * - The limit is checked against the request, not the block handed out.
+ */
+
+#define ITEM_SIZE 1024
+#define MAX_ITEMS 256
+
+static void *cache[MAX_ITEMS];
+static int cached = 0;
+static int soft_calls = 0;
+static int hard_calls = 0;
+
+static void drop_cache(int keep) {
+  while (cached > keep) {
+    my_free(cache[--cached]);
+  }
+}
+
+// Soft pressure halves the cache, hard pressure empties it
+static void on_pressure(MyPressureLevel level, size_t usage, void *arg) {
+  assert(arg == &cached);
+  if (level == MY_PRESSURE_SOFT) {
+    soft_calls++;
+    drop_cache(cached / 2);
+  } else {
+    hard_calls++;
+    drop_cache(0);
+  }
+}
+
+int main(void) {
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  size_t base = stats.current_usage;
+  size_t soft = base + 64 * ITEM_SIZE;
+  size_t hard = base + 128 * ITEM_SIZE;
+  my_malloc_set_limits(soft, hard);
+  assert(my_malloc_add_pressure_callback(on_pressure, &cached) == 0);
+
+  // Fill the cache past the soft limit; only the first crossing fires
+  for (int i = 0; i < 80; i++) {
+    cache[cached++] = mallocing(ITEM_SIZE);
+    memset(cache[cached - 1], i, ITEM_SIZE);
+  }
+  my_malloc_stats(&stats);
+  if (soft_calls != 1 || stats.pressure_events != 1) {
+    fprintf(stderr, "soft limit fired %d times, %zu events\n", soft_calls, stats.pressure_events);
+    return 1;
+  }
+  if (stats.current_usage > soft) {
+    fprintf(stderr, "the callback did not trim the cache\n");
+    return 1;
+  }
+
+  // Over the hard limit, the callback empties the cache and the retry fits
+  void *big = my_malloc(100 * ITEM_SIZE);
+  if (big == NULL || hard_calls != 1) {
+    fprintf(stderr, "hard limit: %p after %d callbacks\n", big, hard_calls);
+    return 1;
+  }
+  if (cached != 0) {
+    fprintf(stderr, "hard pressure left %d cached items\n", cached);
+    return 1;
+  }
+
+  // Nothing left to drop, so a request over the limit fails
+  if (my_malloc(64 * ITEM_SIZE) != NULL) {
+    fprintf(stderr, "an allocation past the hard limit succeeded\n");
+    return 1;
+  }
+  my_malloc_stats(&stats);
+  if (stats.limit_failures < 2 || stats.hard_limit != hard || stats.soft_limit != soft) {
+    fprintf(stderr, "stats report %zu refused allocations\n", stats.limit_failures);
+    return 1;
+  }
+
+  // The callbacks already ran for the refused request, so the next
+  // allocation must not run them again
+  int calls = soft_calls + hard_calls;
+  void *small = mallocing(16);
+  if (soft_calls + hard_calls != calls) {
+    fprintf(stderr, "a refused retry left pressure pending\n");
+    return 1;
+  }
+  my_free(small);
+
+  // Removing the limits lets it through
+  my_malloc_set_limits(0, 0);
+  void *p = mallocing(64 * ITEM_SIZE);
+  my_free(p);
+
+  // A directly mapped block is rounded up to whole pages, and all of it
+  // counts against the hard limit
+  my_malloc_stats(&stats);
+  size_t large = (100 << 20) + 1;
+  my_malloc_set_limits(0, stats.current_usage + large + 8);
+  p = my_malloc(large);
+  my_malloc_stats(&stats);
+  if (p != NULL && stats.current_usage > stats.hard_limit) {
+    fprintf(stderr, "usage %zu is over the hard limit %zu\n", stats.current_usage, stats.hard_limit);
+    return 1;
+  }
+  my_free(p);
+  my_malloc_set_limits(0, 0);
+  my_free(big);
+  return 0;
+}
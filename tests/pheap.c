@@ -0,0 +1,201 @@
+#include "testing.h"
+#include "../src/mypheap.h"
+#include <stdint.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * This test builds a linked list in a file-backed persistent heap, frees part
+ * of it, and opens the file again: at the same time from a second handle, and
+ * after closing it at a fixed address. The list must be intact every time,
+ * whatever address the heap is mapped at. Freeing everything must coalesce
+ * the heap back into one block. A forked process then allocates from a
+ * memfd heap at the same time as its parent, and neither may overwrite the
+ * other's objects, nor may the parent's objects overlap after a forked
+ * process is killed in the middle of its calls. A pointer to a forged block
+ * must not be freed, and a file that is not a heap must be refused.
+ *
+ * Reason(s) you might be failing this test:
+ * - Free-list links or the root are stored as pointers instead of offsets.
+ * - Blocks are not coalesced with their neighbours on free.
+ * - The heap lock is not shared between processes.
+ * - The free lists are not rebuilt after a process dies holding the lock.
+ */
+
+#define HEAP_SIZE (1 << 20)
+#define NODES 1000
+#define SHARED_OBJECTS 2000
+
+typedef struct {
+  uint64_t next;
+  uint64_t value;
+} Node;
+
+static int check_list(MyPHeap *heap, int n) {
+  Node *node = my_pheap_root(heap);
+  // Only the even nodes are left
+  for (int i = 0; i < n; i += 2) {
+    if (node == NULL || node->value != (uint64_t)i) return 0;
+    node = my_pheap_ptr(heap, node->next);
+  }
+  return node == NULL;
+}
+
+// Allocate objects filled with `tag`, recording their offsets
+static void fill_objects(MyPHeap *heap, uint64_t *offsets, unsigned char tag) {
+  for (int i = 0; i < SHARED_OBJECTS; i++) {
+    size_t size = 16 + (i % 13) * 24;
+    unsigned char *p = my_pheap_malloc(heap, size);
+    CHECK_NULL(p);
+    memset(p, tag, size);
+    offsets[i] = my_pheap_offset(heap, p);
+  }
+}
+
+static int check_objects(MyPHeap *heap, const uint64_t *offsets, unsigned char tag) {
+  for (int i = 0; i < SHARED_OBJECTS; i++) {
+    unsigned char *p = my_pheap_ptr(heap, offsets[i]);
+    for (size_t j = 0; j < 16 + (i % 13) * 24; j++) {
+      if (p[j] != tag) return 0;
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+  char path[] = "/tmp/pheapXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  // Build a list of differently sized nodes, then free the odd ones
+  MyPHeap *heap = my_pheap_open(path, HEAP_SIZE, NULL);
+  CHECK_NULL(heap);
+  Node *head = NULL;
+  for (int i = NODES - 1; i >= 0; i--) {
+    Node *node = my_pheap_malloc(heap, sizeof(Node) + (i % 5) * 8);
+    CHECK_NULL(node);
+    node->value = i;
+    node->next = my_pheap_offset(heap, head);
+    head = node;
+  }
+  for (Node *node = head; node != NULL; node = my_pheap_ptr(heap, node->next)) {
+    Node *odd = my_pheap_ptr(heap, node->next);
+    node->next = odd->next;
+    my_pheap_free(heap, odd);
+  }
+  my_pheap_set_root(heap, head);
+  size_t usage = my_pheap_usage(heap);
+
+  // A second handle maps the same heap somewhere else
+  MyPHeap *other = my_pheap_open(path, 0, NULL);
+  CHECK_NULL(other);
+  if (other->base == heap->base || !check_list(other, NODES)) {
+    fprintf(stderr, "a second handle does not see the list\n");
+    return 1;
+  }
+  my_pheap_close(other);
+  my_pheap_close(heap);
+
+  // Reopen at an address chosen here
+  void *base = mmap(NULL, HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(base != MAP_FAILED);
+  munmap(base, HEAP_SIZE);
+  heap = my_pheap_open(path, 0, base);
+  CHECK_NULL(heap);
+  if (heap->base != base || !check_list(heap, NODES) || my_pheap_usage(heap) != usage) {
+    fprintf(stderr, "the list was not intact after reopening\n");
+    return 1;
+  }
+
+  // Free the rest; one allocation must then take nearly the whole heap
+  Node *node = my_pheap_root(heap);
+  while (node != NULL) {
+    Node *next = my_pheap_ptr(heap, node->next);
+    my_pheap_free(heap, node);
+    node = next;
+  }
+  my_pheap_set_root(heap, NULL);
+  void *all = my_pheap_malloc(heap, HEAP_SIZE - 4096);
+  if (my_pheap_usage(heap) != HEAP_SIZE - 4096 || all == NULL) {
+    fprintf(stderr, "free blocks were not coalesced\n");
+    return 1;
+  }
+  // A pointer to a header with no matching footer is not a block
+  uint64_t *words = all;
+  words[8] = 64 | ALLOCATED_FLAG;
+  my_pheap_free(heap, &words[9]);
+  if (my_pheap_usage(heap) != HEAP_SIZE - 4096) {
+    fprintf(stderr, "a forged block was freed\n");
+    return 1;
+  }
+  my_pheap_free(heap, all);
+  my_pheap_close(heap);
+  unlink(path);
+
+  // A forked process and its parent allocate from one heap at once
+  heap = my_pheap_open(NULL, 4 * HEAP_SIZE, NULL);
+  CHECK_NULL(heap);
+  uint64_t *child_offsets = my_pheap_malloc(heap, SHARED_OBJECTS * sizeof(uint64_t));
+  CHECK_NULL(child_offsets);
+  my_pheap_set_root(heap, child_offsets);
+  pid_t pid = fork();
+  if (pid == 0) {
+    MyPHeap *child = my_pheap_open_fd(heap->fd, 0, NULL);
+    if (child == NULL) _exit(1);
+    fill_objects(child, my_pheap_root(child), 0xC5);
+    my_pheap_close(child);
+    _exit(0);
+  }
+  uint64_t parent_offsets[SHARED_OBJECTS];
+  fill_objects(heap, parent_offsets, 0x9A);
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+      !check_objects(heap, parent_offsets, 0x9A) || !check_objects(heap, child_offsets, 0xC5)) {
+    fprintf(stderr, "objects allocated by two processes overlap\n");
+    return 1;
+  }
+
+  // A process killed, most likely while it holds the lock, leaves a heap the
+  // parent can still allocate from
+  for (int i = 0; i < SHARED_OBJECTS; i++) {
+    my_pheap_free(heap, my_pheap_ptr(heap, parent_offsets[i]));
+  }
+  pid = fork();
+  if (pid == 0) {
+    MyPHeap *child = my_pheap_open_fd(heap->fd, 0, NULL);
+    if (child == NULL) _exit(1);
+    for (unsigned i = 0;; i++) {
+      my_pheap_free(child, my_pheap_malloc(child, 16 + i % 1000));
+    }
+  }
+  usleep(50000);
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  fill_objects(heap, parent_offsets, 0x3C);
+  if (!check_objects(heap, parent_offsets, 0x3C) || !check_objects(heap, child_offsets, 0xC5)) {
+    fprintf(stderr, "objects overlap after a process died holding the lock\n");
+    return 1;
+  }
+  my_pheap_close(heap);
+
+  // A file that is not a heap is refused
+  strcpy(path, "/tmp/pheapXXXXXX");
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  char junk[8192];
+  memset(junk, 0x5A, sizeof(junk));
+  assert(write(fd, junk, sizeof(junk)) == sizeof(junk));
+  close(fd);
+  heap = my_pheap_open(path, 0, NULL);
+  unlink(path);
+  if (heap != NULL) {
+    fprintf(stderr, "a file that is not a heap was opened\n");
+    return 1;
+  }
+  return 0;
+}
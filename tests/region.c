@@ -0,0 +1,61 @@
+#include "testing.h"
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * This test bump-allocates from a region, resets it a few times and checks
+ * that objects are aligned and do not overlap, that a reset reuses the same
+ * memory without growing the heap, and that destroying the region returns
+ * everything.
+ *
+ * Reason(s) you might be failing this test:
+ * - Chunks are dropped on reset instead of being kept for reuse.
+ * - Requests bigger than a chunk are not given a chunk of their own.
+ */
+
+#define OBJECTS 2000
+
+int main(void) {
+  Region *region = my_region_create(4096);
+  CHECK_NULL(region);
+
+  static unsigned char *objects[OBJECTS];
+  void *first = NULL;
+  size_t steady_usage = 0;
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < OBJECTS; i++) {
+      size_t size = 1 + (i * 37) % 200;
+      if (i == OBJECTS / 2) size = 10000;  // Bigger than a chunk
+      objects[i] = my_region_alloc(region, size);
+      CHECK_NULL(objects[i]);
+      assert(((uintptr_t)objects[i] & (sizeof(size_t) - 1)) == 0);
+      memset(objects[i], i & 0xFF, size);
+    }
+    for (int i = 0; i < OBJECTS; i++) {
+      if (objects[i][0] != (i & 0xFF)) {
+        fprintf(stderr, "region object %d overlaps another object\n", i);
+        return 1;
+      }
+    }
+
+    MallocStats stats;
+    my_malloc_stats(&stats);
+    if (round == 0) {
+      first = objects[0];
+      steady_usage = stats.current_usage;
+    } else if (objects[0] != first || stats.current_usage != steady_usage) {
+      fprintf(stderr, "region did not reuse its chunks after a reset\n");
+      return 1;
+    }
+    my_region_reset(region);
+  }
+
+  my_region_destroy(region);
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (stats.current_usage != 0) {
+    fprintf(stderr, "%zu bytes still in use after destroy\n", stats.current_usage);
+    return 1;
+  }
+  return 0;
+}
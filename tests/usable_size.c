@@ -0,0 +1,92 @@
+#include "testing.h"
+#include <string.h>
+
+/**
+ * This test checks `my_malloc_usable_size` and `my_malloc_good_size` on small,
+ * large and directly mapped blocks. Every usable byte must be writable
+ * without disturbing a neighbour, a block allocated with a good size must
+ * report all of it, and a block freed with its usable size must be returned
+ * in full. Sizes the thread cache serves have the good size of their class.
+ * A block reused from a bigger free block keeps the remainder that was too
+ * small to split off, and must report it.
+ *
+ * Reason(s) you might be failing this test:
+ * - The usable size counts the header or footer.
+ * - `my_free_sized` picks the mapped path from the size alone.
+ */
+
+static int fill_and_free(void *p, size_t size) {
+  size_t usable = my_malloc_usable_size(p);
+  if (usable < size) {
+    fprintf(stderr, "a %zu byte request has only %zu usable bytes\n", size, usable);
+    return 0;
+  }
+  memset(p, 0x5A, usable);
+  my_free_sized(p, usable);
+  return 1;
+}
+
+int main(void) {
+  static const size_t sizes[] = {1, 7, 8, 24, 100, 1000, 4096, 200 << 10, 100 << 20};
+  const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+
+  if (my_malloc_good_size(0) != 0 || my_malloc_good_size(kMaxAllocationSize + 1) != 0 ||
+      my_malloc_usable_size(NULL) != 0) {
+    fprintf(stderr, "impossible requests have a size\n");
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t good = my_malloc_good_size(sizes[i]);
+    if (good < sizes[i] || my_malloc_good_size(good) != good) {
+      fprintf(stderr, "good size of %zu is %zu\n", sizes[i], good);
+      return 1;
+    }
+    void *guard = mallocing(16);
+    memset(guard, 0xC3, 16);
+    void *p = mallocing(sizes[i]);
+    if (!fill_and_free(p, sizes[i])) return 1;
+    // Asking for the good size wastes nothing: all of it is usable
+    p = mallocing(good);
+    if (!fill_and_free(p, good)) return 1;
+    for (int j = 0; j < 16; j++) {
+      if (((unsigned char *)guard)[j] != 0xC3) {
+        fprintf(stderr, "writing the usable size of %zu bytes overflowed\n", sizes[i]);
+        return 1;
+      }
+    }
+    my_free(guard);
+  }
+
+#ifndef ENABLE_HARDENED
+  // Sizes the thread cache serves are rounded up to their size class, which
+  // is what an inline my_malloc hands out
+  if (my_malloc_good_size(65) != 80 || my_malloc_good_size(MY_TCACHE_MAX_SIZE) != MY_TCACHE_MAX_SIZE) {
+    fprintf(stderr, "good size of 65 is %zu\n", my_malloc_good_size(65));
+    return 1;
+  }
+#endif
+
+  // Reuse a freed block for a request a little smaller than it
+  void *old = mallocing(100);
+  void *pin = mallocing(16);
+  my_free(old);
+  void *p = mallocing(80);
+#ifndef ENABLE_HARDENED
+  // The old block held 100 bytes rounded up to the alignment
+  size_t usable = my_malloc_usable_size(p);
+  if (p == old && usable != ((100 + kAlignment - 1) & ~(kAlignment - 1))) {
+    fprintf(stderr, "the unsplit remainder is not usable: %zu bytes\n", usable);
+    return 1;
+  }
+#endif
+  if (!fill_and_free(p, 80)) return 1;
+  my_free(pin);
+
+  MallocStats stats;
+  my_malloc_stats(&stats);
+  if (stats.current_usage != 0) {
+    fprintf(stderr, "%zu bytes still in use\n", stats.current_usage);
+    return 1;
+  }
+  return 0;
+}